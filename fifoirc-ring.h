@@ -0,0 +1,157 @@
+/* fifoirc-ring.h - write to fifoirc through shared memory (-R)
+
+   fifoirc -R <path> creates <path>, a ring of memory shared with any number
+   of writers, and the FIFO <path>.bell, which writers only touch to wake
+   fifoirc up when it is idle. A writer does:
+
+     struct fifoirc_ring *r = fifoirc_ring_open("/dev/shm/fifoirc");
+     fifoirc_ring_write(r, "hello", 5);
+     fifoirc_ring_close(r);
+
+   and fifoirc_ring_write() returns -1 with errno set to EAGAIN if the ring
+   is full (fifoirc isn't keeping up), or EMSGSIZE if the line could never
+   fit. Each write is one line; it shouldn't contain a newline. A writer
+   that dies half way through a write leaves the ring stuck, so fifoirc
+   has to be restarted. */
+
+#ifndef FIFOIRC_RING_H
+#define FIFOIRC_RING_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#define FIFOIRC_RING_MAGIC   0x66697263/* "firc" */
+#define FIFOIRC_RING_VERSION 1
+
+/* every record starts with its length, with this bit set once it's written;
+ * records are padded to 8 bytes so a length never wraps around the end */
+#define FIFOIRC_RING_READY 0x80000000u
+#define FIFOIRC_RING_ALIGN 8
+
+struct fifoirc_ring_hdr {
+  uint32_t magic, version;
+  uint32_t size;/* bytes of data after the header, a power of two */
+  uint32_t sleeping;/* fifoirc wants waking up */
+  uint64_t tail;/* where the next record goes; writers race to advance it */
+  uint64_t pad1[5];/* keep the reader's end on its own cache line */
+  uint64_t head;/* where fifoirc will read next */
+  uint64_t pad2[7];
+};
+
+struct fifoirc_ring {
+  struct fifoirc_ring_hdr *hdr;
+  unsigned char *data;
+  size_t maplen;
+  int bell;
+};
+
+static inline void fifoirc_ring_close(struct fifoirc_ring *r) {
+  if(!r) return;
+  munmap(r->hdr, r->maplen);
+  close(r->bell);
+  free(r);
+}
+
+static inline struct fifoirc_ring *fifoirc_ring_open(const char *path) {
+  struct fifoirc_ring *r;
+  struct stat st;
+  char bell[4096];
+  int fd;
+
+  if(snprintf(bell, sizeof(bell), "%s.bell", path) >= (int)sizeof(bell)) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+
+  if(!(r = malloc(sizeof(*r)))) return NULL;
+
+  if((fd = open(path, O_RDWR | O_CLOEXEC)) == -1) {
+    free(r);
+    return NULL;
+  }
+
+  if(fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(*r->hdr)) {
+    close(fd);
+    free(r);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  r->maplen = st.st_size;
+  r->hdr = mmap(NULL, r->maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(r->hdr == MAP_FAILED) {
+    free(r);
+    return NULL;
+  }
+
+  if(r->hdr->magic != FIFOIRC_RING_MAGIC
+     || r->hdr->version != FIFOIRC_RING_VERSION
+     || r->hdr->size + sizeof(*r->hdr) > r->maplen) {
+    munmap(r->hdr, r->maplen);
+    free(r);
+    errno = EINVAL;
+    return NULL;
+  }
+  r->data = (unsigned char *)(r->hdr + 1);
+
+  if((r->bell = open(bell, O_WRONLY | O_NONBLOCK | O_CLOEXEC)) == -1) {
+    munmap(r->hdr, r->maplen);
+    free(r);
+    return NULL;
+  }
+
+  return r;
+}
+
+static inline int fifoirc_ring_write(struct fifoirc_ring *r, const void *buf,
+                                     size_t len) {
+  struct fifoirc_ring_hdr *h = r->hdr;
+  uint64_t tail, need, off, n;
+  uint32_t word;
+
+  need = (sizeof(word) + len + FIFOIRC_RING_ALIGN - 1)
+         & ~(uint64_t)(FIFOIRC_RING_ALIGN - 1);
+  if(len >= FIFOIRC_RING_READY || need > h->size) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  /* claim the space; the ring is full if that would overtake fifoirc */
+  tail = __atomic_load_n(&h->tail, __ATOMIC_RELAXED);
+  do {
+    if(tail + need - __atomic_load_n(&h->head, __ATOMIC_ACQUIRE) > h->size) {
+      errno = EAGAIN;
+      return -1;
+    }
+  } while(!__atomic_compare_exchange_n(&h->tail, &tail, tail + need, 1,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  /* the text may wrap around the end, but the length never does */
+  off = (tail + sizeof(word)) & (h->size - 1);
+  n = h->size - off < len ? h->size - off : len;
+  memcpy(r->data + off, buf, n);
+  memcpy(r->data, (const char *)buf + n, len - n);
+
+  word = len | FIFOIRC_RING_READY;
+  __atomic_store_n((uint32_t *)(r->data + (tail & (h->size - 1))), word,
+                   __ATOMIC_RELEASE);
+
+  /* only the first writer to find fifoirc asleep pays for waking it */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&h->sleeping, __ATOMIC_RELAXED)
+     && __atomic_exchange_n(&h->sleeping, 0, __ATOMIC_ACQ_REL))
+    (void)!write(r->bell, "", 1);/* if it's full, it's ringing already */
+
+  return 0;
+}
+
+#endif
@@ -2,11 +2,22 @@
 
    James Stanley 2010 */
 
+#define _GNU_SOURCE/* for struct ucred and accept4() */
+
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <sys/signalfd.h>
+#include <linux/sockios.h>
 #include <unistd.h>
 #include <signal.h>
 #include <getopt.h>
@@ -19,304 +30,4256 @@
 #include <ctype.h>
 #include <poll.h>
 #include <time.h>
+#include <spawn.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+
+#include "fifoirc-ring.h"
+
+#define INFO     0
+#define IRC_MSG  1
+
+#define BUFLEN 1024
+#define MSGLEN 512/* IRC's limit on a line */
+#define NICKLEN 64
+#define TARGETLEN 200
+
+/* connection states; lines from the FIFO are only sent once we're JOINED */
+#define IRC_CONNECTING  0
+#define IRC_REGISTERING 1
+#define IRC_IDENTIFIED  2
+#define IRC_JOINED      3
+
+/* timeouts, in milliseconds */
+#define CONNECT_TIMEOUT  30000 /* to connect and finish the TLS handshake */
+#define IDENTIFY_TIMEOUT 5000  /* for NickServ to answer before joining anyway */
+#define PING_INTERVAL    300000/* of silence before we PING the server */
+#define PING_TIMEOUT     600000/* of silence before we give up on it */
+#define SHUTDOWN_TIMEOUT 10000 /* to send what's waiting before quitting */
+#define TARGET_IDLE      600000/* before a channel or nick sent to is let go */
+#define TARGET_SWEEP     60000 /* between looks for targets to let go */
+#define FENCE_INTERVAL   5000  /* between PINGs to confirm lines, while busy */
+
+#define QUIT_REASON "fifoirc shutting down"
+
+/* delay before reconnecting, doubled after each failed attempt */
+#define BACKOFF_MIN 1000
+#define BACKOFF_MAX 300000
+
+#define MAXSERVERS 16
+#define MAXCHILDREN 64
+
+#define MAXARGS 64
+
+/* how many targets can be given weights with -W */
+#define MAXWEIGHTS 16
+
+/* lines the server lets us send at once before flood control (-l) kicks in */
+#define FLOOD_BURST 5
+
+/* slots in the -D table of recent lines; a line that lands in a slot taken
+ * by a different one just pushes it out early */
+#define DEDUP_SIZE 1024
+
+/* most programs connected to the -U socket at once */
+#define MAXWRITERS 64
+
+/* a child that dies within RESPAWN_QUICK ms of starting is restarted after
+ * a delay that starts at RESPAWN_MIN and doubles up to RESPAWN_MAX */
+#define RESPAWN_QUICK 5000
+#define RESPAWN_MIN   1000
+#define RESPAWN_MAX   60000
+
+/* what to do when a child isn't reading fast enough */
+#define OVERFLOW_DROP_OLDEST 0
+#define OVERFLOW_DROP_NEWEST 1
+#define OVERFLOW_PAUSE       2
+
+/* messages to allocate at once */
+#define MSG_SLAB 256
+
+/* bytes in the -R shared memory ring, and most lines to take from it before
+ * seeing to everything else */
+#define RING_SIZE  (1 << 20)
+#define RING_BATCH 1024
+
+/* descriptors in the main loop's poll(): the FIFOs, the server, the
+ * signalfd, the ring's bell, the -U socket, children and writers */
+#define MAXPOLL (7 + MAXCHILDREN + MAXWRITERS)
+
+/* most of the -a FIFO looked at in one go */
+#define RAW_PEEK 16384
+
+/* -E uring: entries in the submission queue, and most writes to the server
+ * that can be waiting or in flight */
+#define URING_ENTRIES 256
+#define URING_SLOTS   MAXPOLL
+#define URING_WRITES  64
+
+/* handing over to a new binary on SIGUSR2: the state's format, where the
+ * new binary finds it, and most descriptors that go with it */
+#define UPGRADE_MAGIC   0x66697570/* "fiup" */
+#define UPGRADE_VERSION 5
+#define UPGRADE_ENV     "FIFOIRC_UPGRADE"
+#define MAXPASS         (9 + MAXCHILDREN + 1 + MAXWRITERS)
+
+static char *servers[MAXSERVERS] = { "irc.freenode.net" };
+static int nservers, cur_server;
+static char *server;
+static char *channel = "#maximilian";
+static char *nickname;
+static uint16_t port;
+static char *fifo, *urgent_fifo, *fullname, *nspasswd, *program, *tls_cert;
+static char *ring_path, *ring_bell, *sock_path, *config_path, *raw_fifo;
+static char **main_argv;
+
+/* options given after -i on the command line, applied again over the file
+ * each time it's reloaded, and what the file left behind for them to add to */
+struct cli_option {
+  int opt;
+  char *arg;
+};
+
+static struct cli_option *cli_options;
+static int ncli_options;
+static int file_verbose, file_nservers, file_nweights;
+
+/* values read from the -i file, which settings point into for as long as
+ * we run; one that's already here is used again rather than copied */
+static char **config_values;
+static size_t nconfig_values;
+static int verbose, reconnect, use_tls, tls_noverify;
+static int direct_exec, use_standby, json_mode, route_fifo, use_uring;
+static int use_commands;
+static char *program_argv[MAXARGS];
+static int fifo_perms = 0666;
+static unsigned long spool_max = 10000;
+static long long flood_interval, flood_tat;
+static int flood_burst = FLOOD_BURST;
+
+/* -W target=weight */
+struct weight {
+  char *name;/* up to the '=', as the option is left as it was */
+  size_t namelen;
+  unsigned long weight;
+};
+
+static struct weight weights[MAXWEIGHTS];
+static int nweights;
+
+/* with -D, a line repeated within the window is only counted, and the count
+ * is sent once the window is over */
+struct dedup {
+  uint64_t hash;
+  struct target *to;
+  int lane, kind;
+  long long since;
+  unsigned long repeats;
+  char *text;/* kept for the summary once there is a repeat */
+};
+
+static long long dedup_window;
+static struct dedup dedup[DEDUP_SIZE];
+static unsigned long dedup_pending;/* slots with repeats to report */
+static unsigned long lines_repeated;
+
+static long long recv_ms;
+static int ping_sent;
+
+static int irc_state;
+static int irc_events;/* what we're waiting for while connecting */
+static long long connect_ms, connect_deadline, identify_deadline;
+static long long reconnect_at, backoff = BACKOFF_MIN;
+static int delivered;/* sent anything since connecting? */
+static int sasl_done;
+static char cur_nick[NICKLEN];
+static unsigned long lines_sent, lines_confirmed, lines_retried, lines_lost;
+static long long shutdown_at;
+static unsigned long shutdown_sent;/* lines_sent when shutdown began */
+
+/* IRCv3 capabilities we know how to use */
+struct cap {
+  const char *name;
+  int offered, enabled;
+};
+
+static struct cap caps[] = {
+  { "sasl" },
+  { "echo-message" },
+  { "batch" },
+  { "message-tags" },
+  { "server-time" },
+};
+
+#define NCAPS (sizeof(caps) / sizeof(caps[0]))
+#define CAP_SASL         0
+#define CAP_ECHO_MESSAGE 1
+#define CAP_BATCH        2
+#define CAP_MESSAGE_TAGS 3
+#define CAP_SERVER_TIME  4
+
+/* what a queued line is: text for a PRIVMSG or (with -S) a NOTICE to its
+ * target, or a whole command, sent as it is */
+#define MSG_PRIVMSG 0
+#define MSG_NOTICE  1
+#define MSG_COMMAND 2
+
+/* lines waiting to be sent to the server, and lines sent but not yet
+ * confirmed, which are sent again if the connection is lost */
+struct msg {
+  struct msg *next;
+  struct target *to;
+  int lane;
+  int kind;
+  long long queued;/* when, for the latency stats */
+  unsigned long seq;
+  size_t len;
+  char text[MSGLEN];/* without the PRIVMSG, which is the target's head */
+};
+
+/* messages are carved out of slabs of MSG_SLAB and go back on a freelist
+ * rather than to free(), so once the queues have been as long as they're
+ * going to get, queuing and sending lines doesn't allocate at all */
+static struct msg *msg_pool;
+static unsigned long msgs_used, msgs_hiwat, msg_slabs;
+
+/* urgent lines (from the -u FIFO) are sent before any bulk ones */
+#define LANE_URGENT 0
+#define LANE_BULK   1
+#define NLANES      2
+
+struct lane {
+  struct msg *head, *tail;
+  struct msg *requeued;/* the last line put back by queue_requeue() */
+  unsigned long len;
+};
+
+static const char *lane_names[NLANES] = { "urgent", "bulk" };
+static unsigned long lane_lines[NLANES];
+static long long lane_wait[NLANES], lane_worst[NLANES];
+
+/* each channel or nick we send to has its own queues, so that one we can't
+ * send to yet (say we're still joining it) doesn't hold up the others */
+struct target {
+  struct target *next;
+  struct lane lane[NLANES];
+  unsigned long len, sent;
+  unsigned long quantum;/* lines it may send each round (its -W weight) */
+  unsigned long deficit;/* lines it may still send this round */
+  int turn;/* whether this round's quantum has been added */
+  int joined, joining;
+  int ours;/* joined only to send there, so left again once idle */
+  long long used;/* when a line was last queued for it */
+  int busy;/* still pointed at, while target_expire() looks */
+  char name[TARGETLEN];
+  char head[TARGETLEN + 16];/* "PRIVMSG <name> :", made once */
+  char notice[TARGETLEN + 16];/* and "NOTICE <name> :" */
+  size_t headlen, noticelen;
+};
+
+static struct target *targets, *cur_target, *cur_urgent;
+static int ntargets;
+static unsigned long queue_len;/* lines waiting, over all the targets */
+static struct msg *sent_head, *sent_tail;
+static unsigned long next_seq = 1;
+static unsigned long fence_seq;/* sequence number of the PING in flight */
+static long long fence_ms;/* when the last one was sent */
+
+extern char **environ;
+
+static int fifo_fd = -1, urgent_fd = -1, irc_fd = -1, sig_fd = -1;
+static int raw_fd = -1, raw_pipe[2] = { -1, -1 };
+static int bell_fd = -1, ring_fd = -1;
+static struct fifoirc_ring_hdr *ring;
+static int listen_fd = -1;
+
+/* programs connected to the -U socket, and who they are */
+struct writer {
+  int fd;
+  pid_t pid;
+  uid_t uid;
+  unsigned long lines;
+};
+
+static struct writer writers[MAXWRITERS];
+static int nwriters;
+
+/* partial lines read from a FIFO or socket */
+struct linebuf {
+  char buf[BUFLEN];
+  size_t len;
+};
+
+static struct linebuf fifo_in, urgent_in;
+
+/* -a: the start of a raw line that came in pieces, or we're skipping the
+ * rest of one that was too long */
+static struct linebuf raw_in;
+static int raw_skip;
+static unsigned long raw_lines, raw_dropped;
+
+/* the -e program runs as a pool of children, each on its own non-blocking
+ * socket; what a child hasn't taken yet waits in its out buffer, which is
+ * allowed up to child_hiwat bytes plus one line */
+struct child {
+  pid_t pid;
+  int fd;
+  char *out;
+  size_t outlen;
+  int partial;/* the first line in out has been partly written */
+  struct linebuf in;
+  long long started, respawn_at, respawn_delay;
+  unsigned long sent, replies, dropped;
+};
+
+/* with -w a spare child is kept running, to take over straight away from
+ * one that dies */
+static struct child children[MAXCHILDREN], standby;
+static int nchildren = 1, next_child;
+static int dispatch_least;/* to the least busy child, not round-robin */
+static size_t child_hiwat = 65536;
+static int overflow = OVERFLOW_DROP_OLDEST;
+static unsigned long child_dropped;
+
+/* TLS state; the session is kept across reconnects so that the next
+ * handshake can be resumed instead of done in full */
+static SSL_CTX *tls_ctx;
+static SSL *tls;
+static SSL_SESSION *tls_session;
+static const char *tls_session_server;
+
+/* buffered input from the IRC server */
+static char irc_buf[BUFLEN];
+static size_t irc_buflen;
+
+static void usage(void) {
+  puts("fifoirc by James Stanley\n"
+       "Usage: fifoirc [-a <raw fifo>] [-b <bytes>] [-c <channel>]\n"
+       "               [-C <certificate>] [-d rr|least] [-D <seconds>]\n"
+       "               [-e <program>] [-E poll|uring]\n"
+       "               [-i <config file>] [-j <children>] [-J]\n"
+       "               [-f <path to fifo>] [-F <full name>] [-m <mode>]\n"
+       "               [-l <ms>[:<burst>]] [-W <target>=<weight>]...\n"
+       "               [-n <nickname>] [-o oldest|newest|pause]\n"
+       "               [-p <port>] [-P <password>] [-q <lines>] [-r]\n"
+       "               [-R <shared memory ring>]\n"
+       "               [-s <server>]... [-S] [-t] [-T] [-k]\n"
+       "               [-u <urgent fifo>] [-U <socket>] [-vv] [-w] [-x]\n"
+       "\n"
+       "Options:\n"
+       " -a  also read lines from a FIFO that are already IRC commands,\n"
+       "     ending in CRLF, and pass them to the server as they are\n"
+       " -b  most bytes to hold for an -e child that isn't reading\n"
+       "     (default: 65536)\n"
+       " -c  channel to join\n"
+       " -C  TLS client certificate and key (PEM), for SASL EXTERNAL\n"
+       " -d  hand IRC text to the -e children round-robin (rr, the default)\n"
+       "     or to the least busy one (least)\n"
+       " -D  send a line repeated within this many seconds only once, then\n"
+       "     say how many times it was repeated\n"
+       " -e  program to pipe IRC text to (note: uses 'sh -c' unless -x)\n"
+       " -E  wait for events with poll() (the default) or io_uring\n"
+       " -f  path to the FIFO to use\n"
+       " -F  IRC full name\n"
+       " -i  read settings from a file, and again on SIGHUP\n"
+       " -j  number of copies of the -e program to run (default: 1)\n"
+       " -J  talk to the -e program in JSON, one object per line\n"
+       " -k  don't verify the server's TLS certificate\n"
+       " -l  send at most one line every <ms> milliseconds, after a burst of\n"
+       "     up to <burst> lines (default: 5); e.g. -l 2000\n"
+       " -m  FIFO permission modes in octal (default: 0666)\n"
+       " -n  IRC nickname\n"
+       " -o  when an -e child falls -b bytes behind, drop its oldest lines\n"
+       "     (the default), drop new ones, or pause reading from the server\n"
+       " -p  port on the IRC server (default: 6667, or 6697 with -t)\n"
+       " -P  password to authenticate with SASL or NickServ\n"
+       " -q  most lines to hold while not connected (default: 10000)\n"
+       " -r  reconnect to the server if the connection is lost\n"
+       " -R  also read lines from a shared memory ring made at this path\n"
+       "     (see fifoirc-ring.h)\n"
+       " -s  server to connect to; give more than once to rotate between them\n"
+       " -S  send lines starting with / as IRC commands: /msg or /notice\n"
+       "     <target> <text>, or any other as it is, e.g. /topic #chan :text\n"
+       "     (// for a line that starts with /)\n"
+       " -t  connect to the server using TLS\n"
+       " -T  send FIFO lines of the form 'target<TAB>text' to that target\n"
+       " -u  also read lines from a second FIFO, which are sent ahead of\n"
+       "     any others waiting\n"
+       " -U  also take messages from programs connecting to a Unix socket\n"
+       "     made at this path\n"
+       " -v  be verbose, specify twice to increase verbosity\n"
+       " -w  keep a spare copy of the -e program running to replace one that\n"
+       "     exits\n"
+       " -W  give a channel or nick a bigger share of what is sent when\n"
+       "     several have lines waiting (default weight: 1)\n"
+       " -x  run the -e program directly instead of with 'sh -c', splitting\n"
+       "     it into arguments at spaces\n"
+       );
+  exit(0);
+}
+
+static long long now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* with -E uring, poll() is replaced by io_uring: each descriptor's poll
+ * stays armed across trips round the main loop rather than being passed
+ * in again every time, and lines for the server are queued as a linked
+ * chain of writes that is submitted along with the wait, so that a batch of
+ * lines and the wait for what happens next cost one system call between
+ * them. There's no liburing here, so the rings are set up by hand */
+struct uring_slot {
+  int armed;
+  int fd;
+  short events, revents;/* revents from a completion not yet handed out */
+  uint64_t gen;
+};
+
+/* a write to the server, kept until it has all been written; its iovecs
+ * point at text that lasts (a target's head, a queued line) or at buf */
+struct uring_write {
+  struct iovec iov[3];
+  int niov;
+  size_t left;
+  int busy;/* submitted, and not completed yet */
+  char buf[BUFLEN];
+};
+
+static int uring_fd = -1;
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+static unsigned sq_pending;/* SQEs filled in but not submitted */
+static struct uring_slot uring_slots[URING_SLOTS];
+static uint64_t uring_gen;
+static struct uring_write uring_writes[URING_WRITES];
+static int uring_whead, uring_nwrites, uring_inflight;
+static unsigned long uring_enters;
+
+#define URING_POLL   1ULL
+#define URING_WRITE  2ULL
+#define URING_REMOVE 3ULL
+#define URING_DATA(kind, gen, i) ((kind) << 56 | (gen) << 16 | (i))
+
+static int make_uring(void) {
+  struct io_uring_params p;
+  size_t sq_len, cq_len;
+  unsigned char *sq, *cq;
+
+  memset(&p, 0, sizeof(p));
+  if((uring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) == -1) {
+    perror("fifoirc: io_uring_setup");
+    return -1;
+  }
+
+  /* the one mmap() for both rings came in 5.4, and timeouts on the wait
+   * in 5.11 */
+  if(!(p.features & IORING_FEAT_SINGLE_MMAP)
+     || !(p.features & IORING_FEAT_EXT_ARG)) {
+    fprintf(stderr, "fifoirc: io_uring: kernel too old\n");
+    close(uring_fd);
+    uring_fd = -1;
+    return -1;
+  }
+
+  sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if(cq_len > sq_len) sq_len = cq_len;
+
+  sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            uring_fd, IORING_OFF_SQ_RING);
+  sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+              PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring_fd,
+              IORING_OFF_SQES);
+  if(sq == MAP_FAILED || sqes == MAP_FAILED) {
+    perror("fifoirc: io_uring mmap");
+    close(uring_fd);
+    uring_fd = -1;
+    return -1;
+  }
+  cq = sq;
+
+  sq_head = (unsigned *)(sq + p.sq_off.head);
+  sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  sq_array = (unsigned *)(sq + p.sq_off.array);
+  cq_head = (unsigned *)(cq + p.cq_off.head);
+  cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  return 0;
+}
+
+/* submit what's waiting, and with min, wait for that many completions or
+ * for timeout ms */
+static int uring_enter(unsigned min, int timeout) {
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned flags = 0;
+  int n;
+
+  memset(&arg, 0, sizeof(arg));
+  if(min) {
+    flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    if(timeout >= 0) {
+      ts.tv_sec = timeout / 1000;
+      ts.tv_nsec = (timeout % 1000) * 1000000LL;
+      arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+  }
+
+  if(!sq_pending && !min) return 0;
+
+  uring_enters++;
+  n = syscall(__NR_io_uring_enter, uring_fd, sq_pending, min, flags,
+              min ? &arg : NULL, min ? sizeof(arg) : 0);
+  if(n >= 0) sq_pending -= n;
+  else if(errno == ETIME || errno == EINTR || errno == EBUSY) n = 0;
+
+  return n;
+}
+
+static struct io_uring_sqe *uring_sqe(void) {
+  struct io_uring_sqe *sqe;
+  unsigned tail = *sq_tail;
+
+  /* full: hand the kernel what's there to make room */
+  if(tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) > *sq_mask)
+    uring_enter(0, 0);
+
+  sqe = &sqes[tail & *sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array[tail & *sq_mask] = tail & *sq_mask;
+  __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+  sq_pending++;
+
+  return sqe;
+}
+
+static void uring_unarm(int i) {
+  struct uring_slot *s = &uring_slots[i];
+  struct io_uring_sqe *sqe;
+
+  if(s->armed) {
+    sqe = uring_sqe();
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->addr = URING_DATA(URING_POLL, s->gen, i);
+    sqe->user_data = URING_DATA(URING_REMOVE, 0ULL, i);
+  }
+  s->armed = 0;
+  s->revents = 0;
+}
+
+static void uring_arm(int i, int fd, short events) {
+  struct uring_slot *s = &uring_slots[i];
+  struct io_uring_sqe *sqe;
+
+  s->armed = 1;
+  s->fd = fd;
+  s->events = events;
+  s->gen = ++uring_gen & 0xffffffffffULL;
+
+  sqe = uring_sqe();
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = events;
+  sqe->user_data = URING_DATA(URING_POLL, s->gen, i);
+}
+
+/* a descriptor that's being closed mustn't be left with a poll on it, or
+ * the poll would keep it open */
+static void uring_forget(int fd) {
+  int i;
+
+  for(i = 0; uring_fd != -1 && i < URING_SLOTS; i++)
+    if(uring_slots[i].fd == fd && (uring_slots[i].armed
+                                   || uring_slots[i].revents))
+      uring_unarm(i);
+}
+
+static void fd_close(int fd) {
+  uring_forget(fd);
+  close(fd);
+}
+
+/* a write has finished, or some of it has; writes are linked, so after a
+ * short one the rest come back cancelled and are sent again */
+static void uring_written(int i, int res) {
+  struct uring_write *w = &uring_writes[i];
+  int j, k;
+
+  w->busy = 0;
+  uring_inflight--;
+
+  if(res == -ECANCELED) return;
+  if(res < 0) {
+    /* the connection has gone; that will be noticed when it's read */
+    for(j = 0; j < uring_nwrites; j++)
+      uring_writes[(uring_whead + j) % URING_WRITES].left = 0;
+    return;
+  }
+
+  w->left -= res;
+  for(k = 0; k < w->niov && res; k++) {
+    if((size_t)res < w->iov[k].iov_len) {
+      w->iov[k].iov_base = (char *)w->iov[k].iov_base + res;
+      w->iov[k].iov_len -= res;
+      res = 0;
+    } else {
+      res -= w->iov[k].iov_len;
+      w->iov[k].iov_len = 0;
+    }
+  }
+}
+
+static void uring_reap(void) {
+  unsigned head = *cq_head;
+  struct io_uring_cqe *cqe;
+  struct uring_slot *s;
+  uint64_t kind, gen;
+  int i;
+
+  while(head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+    cqe = &cqes[head & *cq_mask];
+    kind = cqe->user_data >> 56;
+    gen = (cqe->user_data >> 16) & 0xffffffffffULL;
+    i = cqe->user_data & 0xffff;
+
+    if(kind == URING_POLL && i < URING_SLOTS) {
+      /* one-shot, so it's rearmed once it has been dealt with, and fires
+       * straight away if there's still more to read */
+      s = &uring_slots[i];
+      if(s->armed && s->gen == gen) {
+        s->armed = 0;
+        if(cqe->res > 0) s->revents = cqe->res;
+      }
+    } else if(kind == URING_WRITE && i < URING_WRITES) {
+      uring_written(i, cqe->res);
+    }
+
+    head++;
+  }
+  __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+  /* forget writes that are done with */
+  while(uring_nwrites && !uring_writes[uring_whead].busy
+        && !uring_writes[uring_whead].left) {
+    uring_whead = (uring_whead + 1) % URING_WRITES;
+    uring_nwrites--;
+  }
+}
+
+/* writes are only submitted when none are in flight, so that one chain
+ * can't overtake another */
+static void uring_submit_writes(void) {
+  struct io_uring_sqe *sqe = NULL;
+  struct uring_write *w;
+  int i, j;
+
+  if(uring_inflight) return;
+
+  for(j = 0; j < uring_nwrites; j++) {
+    i = (uring_whead + j) % URING_WRITES;
+    w = &uring_writes[i];
+    if(!w->left) continue;
+
+    if(sqe) sqe->flags |= IOSQE_IO_LINK;
+    sqe = uring_sqe();
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = irc_fd;
+    sqe->addr = (uint64_t)(uintptr_t)w->iov;
+    sqe->len = w->niov;
+    sqe->user_data = URING_DATA(URING_WRITE, 0ULL, i);
+    w->busy = 1;
+    uring_inflight++;
+  }
+}
+
+/* the connection is going: forget what wasn't written, and stop what's
+ * stuck waiting for the server to read */
+static void uring_cancel_writes(void) {
+  struct io_uring_sqe *sqe;
+  int i, j;
+
+  for(j = 0; uring_fd != -1 && j < uring_nwrites; j++) {
+    i = (uring_whead + j) % URING_WRITES;
+    uring_writes[i].left = 0;
+    if(!uring_writes[i].busy) continue;
+
+    sqe = uring_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = URING_DATA(URING_WRITE, 0ULL, i);
+    sqe->user_data = URING_DATA(URING_REMOVE, 0ULL, i);
+  }
+}
+
+/* wait for every write to the server to be done, e.g. before we exit */
+static void uring_flush(void) {
+  if(uring_fd == -1) return;
+
+  uring_submit_writes();
+  while(uring_nwrites) {
+    if(uring_enter(uring_inflight ? 1 : 0, -1) == -1) break;
+    uring_reap();
+    uring_submit_writes();
+    if(!uring_inflight && uring_nwrites) break;/* nothing left to write */
+  }
+}
+
+/* queue a line for the server; text in a stack buffer is copied, anything
+ * that was queued lives until it has been confirmed */
+static ssize_t uring_write(const struct iovec *iov, int n, int copy) {
+  struct uring_write *w;
+  size_t len = 0;
+  int i;
+
+  if(uring_nwrites == URING_WRITES) uring_flush();
+  if(uring_nwrites == URING_WRITES) return -1;
+
+  w = &uring_writes[(uring_whead + uring_nwrites++) % URING_WRITES];
+  w->busy = 0;
+  w->niov = copy ? 1 : n;
+  for(i = 0; i < n; i++) {
+    if(copy && len + iov[i].iov_len <= sizeof(w->buf))
+      memcpy(w->buf + len, iov[i].iov_base, iov[i].iov_len);
+    else if(!copy)
+      w->iov[i] = iov[i];
+    len += iov[i].iov_len;
+  }
+  if(copy) {
+    if(len > sizeof(w->buf)) len = sizeof(w->buf);
+    w->iov[0].iov_base = w->buf;
+    w->iov[0].iov_len = len;
+  }
+  w->left = len;
+
+  return len;
+}
+
+/* poll(), from the same pollfds */
+static int uring_poll(struct pollfd *fd, int n, int timeout) {
+  struct uring_slot *s;
+  int i, ready = 0;
+
+  for(i = 0; i < URING_SLOTS; i++) {
+    s = &uring_slots[i];
+    if((s->armed || s->revents) && (i >= n || s->fd != fd[i].fd
+                                    || s->events != fd[i].events))
+      uring_unarm(i);
+    if(i < n && fd[i].fd != -1 && !s->armed && !s->revents)
+      uring_arm(i, fd[i].fd, fd[i].events);
+    if(i < n && s->revents) ready = 1;
+  }
+
+  uring_submit_writes();
+  if(uring_enter(ready || !timeout ? 0 : 1, timeout) == -1) return -1;
+  uring_reap();
+
+  for(i = ready = 0; i < n; i++) {
+    fd[i].revents = uring_slots[i].revents;
+    uring_slots[i].revents = 0;
+    if(fd[i].revents) ready++;
+  }
+
+  return ready;
+}
+
+static int make_fifo(const char *fifo, int *fd) {
+  struct stat buf;
+
+  if(*fd != -1) fd_close(*fd);
+
+  if(stat(fifo, &buf) != -1) {
+    if(!S_ISFIFO(buf.st_mode)) {
+      fprintf(stderr, "fifoirc: %s: exists and is not a fifo\n", fifo);
+      return -1;
+    }
+  } else {
+    umask(0);
+    if(mkfifo(fifo, fifo_perms) == -1) {
+      fprintf(stderr, "fifoirc: mkfifo %s: %s\n", fifo, strerror(errno));
+      return -1;
+    }
+  }
+
+  *fd = open(fifo, O_RDONLY | O_NONBLOCK | O_CLOEXEC, 0);
+  if(*fd == -1) {
+    fprintf(stderr, "fifoirc: open %s: %s\n", fifo, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+static unsigned long count_lines(const char *buf, size_t len) {
+  unsigned long n = 0;
+  const char *p;
+
+  for(p = buf; (p = memchr(p, '\n', buf + len - p)); p++)
+    n++;
+
+  return n;
+}
+
+/* forget a child's socket and whatever it hadn't read */
+static void child_reset(struct child *ch) {
+  if(ch->fd != -1) fd_close(ch->fd);
+  ch->fd = -1;
+
+  if(ch->outlen) {
+    ch->dropped += count_lines(ch->out, ch->outlen);
+    child_dropped += count_lines(ch->out, ch->outlen);
+  }
+  ch->outlen = 0;
+  ch->partial = 0;
+  ch->in.len = 0;
+}
+
+static int start_program(struct child *ch) {
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t sigs;
+  char *sh_argv[] = { "sh", "-c", program, NULL };
+  int fd[2];
+  int err;
+
+  child_reset(ch);
+  ch->respawn_at = 0;
+
+  if(!ch->out && !(ch->out = malloc(child_hiwat + BUFLEN))) {
+    perror("fifoirc: malloc");
+    return -1;
+  }
+
+  /* close-on-exec keeps each child from holding its siblings' sockets */
+  if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fd) == -1) {
+    perror("fifoirc: socketpair");
+    return -1;
+  }
+
+  /* posix_spawn() doesn't copy our address space the way fork() would, and
+   * the child shouldn't inherit our ignoring SIGPIPE or blocking SIGCHLD */
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, fd[0], STDIN_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, fd[0], STDOUT_FILENO);
+  posix_spawnattr_init(&attr);
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGPIPE);
+  posix_spawnattr_setsigdefault(&attr, &sigs);
+  sigemptyset(&sigs);
+  posix_spawnattr_setsigmask(&attr, &sigs);
+  posix_spawnattr_setflags(&attr,
+                           POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+  if(direct_exec)
+    err = posix_spawnp(&ch->pid, program_argv[0], &actions, &attr,
+                       program_argv, environ);
+  else
+    err = posix_spawn(&ch->pid, "/bin/sh", &actions, &attr, sh_argv,
+                      environ);
+
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  close(fd[0]);
+
+  if(err) {
+    fprintf(stderr, "fifoirc: spawn %s: %s\n", program, strerror(err));
+    close(fd[1]);
+    ch->pid = 0;
+    return -1;
+  }
+
+  ch->fd = fd[1];
+  fcntl(ch->fd, F_SETFL, fcntl(ch->fd, F_GETFL) | O_NONBLOCK);
+  ch->started = now_ms();
+
+  if(verbose > INFO)
+    printf(" -- started '%s' (pid %d)%s\n", program, (int)ch->pid,
+           ch == &standby ? " on standby" : "");
+
+  return 0;
+}
+
+/* roughly how much we've written to a child that it hasn't read yet (the
+ * kernel counts its buffer overhead too) */
+static int child_backlog(struct child *ch) {
+  int n;
+
+  if(ioctl(ch->fd, SIOCOUTQ, &n) == -1) n = 0;
+
+  return n + ch->outlen;
+}
+
+/* pick the next child round-robin, or with -d least the one with the
+ * fewest unread bytes (round-robin among equals) */
+static struct child *pick_child(void) {
+  struct child *ch, *best = NULL;
+  int i, n, least = 0;
+
+  for(i = 0; i < nchildren; i++) {
+    ch = &children[(next_child + i) % nchildren];
+    if(ch->fd == -1) continue;
+    if(!dispatch_least) {
+      best = ch;
+      break;
+    }
+
+    n = child_backlog(ch);
+    if(!best || n < least) {
+      best = ch;
+      least = n;
+    }
+  }
+
+  if(best) next_child = (best - children + 1) % nchildren;
+
+  return best;
+}
+
+/* a child that hangs up is no use to us; it's restarted once it's reaped */
+static void child_hangup(struct child *ch) {
+  if(ch->fd != -1) fd_close(ch->fd);
+  ch->fd = -1;
+  kill(ch->pid, SIGTERM);
+}
+
+static void respawn_backoff(struct child *ch) {
+  ch->respawn_delay *= 2;
+  if(ch->respawn_delay < RESPAWN_MIN) ch->respawn_delay = RESPAWN_MIN;
+  if(ch->respawn_delay > RESPAWN_MAX) ch->respawn_delay = RESPAWN_MAX;
+}
+
+static int text_handle(int fd, struct linebuf *lb, void (*fn)(char *));
+static void program_line(char *line);
+
+/* a child has died: put the standby in its place if there is one, and
+ * arrange for whichever slot is now empty to be refilled, later rather than
+ * sooner if children keep dying as soon as they start */
+static void child_exited(struct child *ch) {
+  long long now = now_ms();
+  struct child *empty = ch;
+  int n;
+
+  /* it may have had last words */
+  while(ch->fd != -1
+        && (n = text_handle(ch->fd, &ch->in, program_line)) > 0)
+    ch->replies += n;
+
+  child_reset(ch);
+  ch->pid = 0;
+
+  if(now - ch->started < RESPAWN_QUICK) respawn_backoff(ch);
+  else ch->respawn_delay = 0;
+
+  if(ch != &standby && standby.pid && standby.fd != -1) {
+    ch->pid = standby.pid;
+    ch->fd = standby.fd;
+    ch->started = standby.started;
+    standby.pid = 0;
+    standby.fd = -1;
+    standby.respawn_delay = ch->respawn_delay;
+    empty = &standby;
+
+    if(verbose > INFO)
+      printf(" -- standby (pid %d) took over\n", (int)ch->pid);
+  }
+
+  empty->respawn_at = now + empty->respawn_delay;
+}
+
+/* SIGCHLD is delivered through sig_fd, so that poll() wakes up as soon as a
+ * child dies instead of us asking after every event; so are the rest, so
+ * that they're dealt with between events rather than in a handler */
+static int make_sigfd(void) {
+  sigset_t sigs;
+
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGCHLD);
+  sigaddset(&sigs, SIGUSR2);
+  sigaddset(&sigs, SIGHUP);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGTERM);
+
+  if(sigprocmask(SIG_BLOCK, &sigs, NULL) == -1
+     || (sig_fd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC)) == -1) {
+    perror("fifoirc: signalfd");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* notice children that died; several deaths may share one signal */
+static void reap_children(void) {
+  struct child *ch;
+  pid_t pid;
+  int status;
+
+  while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    for(ch = children; ch < children + nchildren; ch++)
+      if(ch->pid == pid) child_exited(ch);
+    if(standby.pid == pid) child_exited(&standby);
+  }
+}
+
+static void respawn_child(struct child *ch, long long now, long long *next) {
+  if(ch->pid || !ch->respawn_at) return;
+
+  /* if it can't be started now, it may be possible later */
+  if(now >= ch->respawn_at && start_program(ch) == -1) {
+    respawn_backoff(ch);
+    ch->respawn_at = now + ch->respawn_delay;
+  }
+
+  if(ch->respawn_at && ch->respawn_at < *next) *next = ch->respawn_at;
+}
+
+/* start any children that are due, and say when the next one will be */
+static void respawn_children(long long now, long long *next) {
+  int i;
+
+  for(i = 0; i < nchildren; i++)
+    respawn_child(&children[i], now, next);
+
+  if(use_standby) respawn_child(&standby, now, next);
+}
+
+static void child_flush(struct child *ch) {
+  ssize_t n;
+
+  if(!ch->outlen || ch->fd == -1) return;
+
+  n = write(ch->fd, ch->out, ch->outlen);
+  if(n <= 0) return;/* full up, or gone and we'll hear about it */
+
+  ch->partial = ch->out[n - 1] != '\n';
+  ch->outlen -= n;
+  memmove(ch->out, ch->out + n, ch->outlen);
+}
+
+static void child_drop(struct child *ch, unsigned long n) {
+  ch->dropped += n;
+  child_dropped += n;
+}
+
+/* make room for len more bytes by dropping whole lines from the front,
+ * except one the child has already seen part of */
+static void child_drop_oldest(struct child *ch, size_t len) {
+  char *start, *p, *end = ch->out + ch->outlen;
+
+  start = ch->out;
+  if(ch->partial) {
+    if(!(p = memchr(start, '\n', ch->outlen))) return;
+    start = p + 1;
+  }
+
+  for(p = start; p < end && (end - p) + (start - ch->out) + len > child_hiwat;) {
+    if(!(p = memchr(p, '\n', end - p))) break;
+    p++;
+    child_drop(ch, 1);
+  }
+
+  if(!p) p = end;
+  memmove(start, p, end - p);
+  ch->outlen -= p - start;
+}
+
+static void program_write(const char *text) {
+  struct child *ch;
+  size_t len = strlen(text);
+
+  if(!program || !(ch = pick_child())) return;
+
+  ch->sent++;
+
+  if(ch->outlen + len > child_hiwat) {
+    if(overflow == OVERFLOW_DROP_NEWEST) {
+      child_drop(ch, 1);
+      return;
+    }
+    if(overflow == OVERFLOW_DROP_OLDEST) child_drop_oldest(ch, len);
+    /* with OVERFLOW_PAUSE we stop reading from the server instead, but
+     * still have room for the line in hand */
+  }
+
+  if(ch->outlen + len > child_hiwat + BUFLEN) {
+    child_drop(ch, 1);
+    return;
+  }
+
+  memcpy(ch->out + ch->outlen, text, len);
+  ch->outlen += len;
+
+  child_flush(ch);
+}
+
+/* with OVERFLOW_PAUSE, is any child too far behind for us to read more? */
+static int children_full(void) {
+  int i;
+
+  if(overflow != OVERFLOW_PAUSE) return 0;
+
+  for(i = 0; program && i < nchildren; i++)
+    if(children[i].outlen >= child_hiwat) return 1;
+
+  return 0;
+}
+
+/* start connecting to host; irc_connecting() finishes the job once poll()
+ * says the socket is ready */
+static int make_tcp(const char *host, uint16_t port) {
+  struct addrinfo hints, *res, *ai;
+  char service[8];
+  int fd = -1;
+  int one = 1;
+  int err;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(service, sizeof(service), "%hu", port);
+
+  if((err = getaddrinfo(host, service, &hints, &res)) != 0) {
+    fprintf(stderr, "fifoirc: getaddrinfo %s: %s\n", host, gai_strerror(err));
+    return -1;
+  }
+
+  for(ai = res; ai; ai = ai->ai_next) {
+    fd = socket(ai->ai_family,
+                ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                ai->ai_protocol);
+    if(fd == -1) {
+      err = errno;
+      continue;
+    }
+
+    /* we write a line at a time and wait on the replies, which is just what
+     * Nagle's algorithm makes slow */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if(connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 || errno == EINPROGRESS)
+      break;
+
+    err = errno;
+    close(fd);
+    fd = -1;
+  }
+
+  freeaddrinfo(res);
+
+  if(fd == -1)
+    fprintf(stderr, "fifoirc: connect %s: %s\n", host, strerror(err));
+
+  return fd;
+}
+
+static void tls_perror(const char *s) {
+  char err[256];
+
+  ERR_error_string_n(ERR_get_error(), err, sizeof(err));
+  fprintf(stderr, "fifoirc: %s: %s\n", s, err);
+}
+
+/* called by OpenSSL whenever the server hands us a new session (or ticket);
+ * we hold on to a copy of the most recent one for the next connection.  It
+ * has to be a copy because OpenSSL invalidates the connection's own session
+ * when the connection dies with an error, which is how most of ours end */
+static int tls_new_session(SSL *ssl, SSL_SESSION *sess) {
+  if(tls_session) SSL_SESSION_free(tls_session);
+  tls_session = SSL_SESSION_dup(sess);
+  tls_session_server = server;
+
+  return 0;
+}
+
+static int tls_init(void) {
+  tls_ctx = SSL_CTX_new(TLS_client_method());
+  if(!tls_ctx) {
+    tls_perror("SSL_CTX_new");
+    return -1;
+  }
+
+  SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+
+  if(!tls_noverify) {
+    SSL_CTX_set_verify(tls_ctx, SSL_VERIFY_PEER, NULL);
+    if(SSL_CTX_set_default_verify_paths(tls_ctx) != 1) {
+      tls_perror("SSL_CTX_set_default_verify_paths");
+      return -1;
+    }
+  }
+
+  if(tls_cert) {
+    if(SSL_CTX_use_certificate_chain_file(tls_ctx, tls_cert) != 1) {
+      tls_perror(tls_cert);
+      return -1;
+    }
+    if(SSL_CTX_use_PrivateKey_file(tls_ctx, tls_cert, SSL_FILETYPE_PEM) != 1) {
+      tls_perror(tls_cert);
+      return -1;
+    }
+  }
+
+  SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_CLIENT
+                                          | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(tls_ctx, tls_new_session);
+
+  return 0;
+}
+
+static int tls_start(int fd) {
+  tls = SSL_new(tls_ctx);
+  if(!tls) {
+    tls_perror("SSL_new");
+    return -1;
+  }
+
+  SSL_set_fd(tls, fd);
+  SSL_set_tlsext_host_name(tls, server);
+  if(!tls_noverify) SSL_set1_host(tls, server);
+
+  /* a session is only any good to the server that issued it */
+  if(tls_session && tls_session_server == server)
+    SSL_set_session(tls, tls_session);
+
+  return 0;
+}
+
+static ssize_t irc_send(const void *buf, size_t len) {
+  int n;
+
+  if(irc_fd == -1) return -1;
+
+  if(!tls) return write(irc_fd, buf, len);
+
+  n = SSL_write(tls, buf, len);
+  return n > 0 ? n : -1;
+}
+
+/* TLS has no writev(), so the pieces are put together for it */
+static ssize_t irc_sendv(const struct iovec *iov, int n) {
+  char buf[BUFLEN];
+  size_t len = 0;
+  int i;
+
+  if(irc_fd == -1) return -1;
+
+  if(!tls && uring_fd != -1) return uring_write(iov, n, 1);
+  if(!tls) return writev(irc_fd, iov, n);
+
+  for(i = 0; i < n && len + iov[i].iov_len <= sizeof(buf); i++) {
+    memcpy(buf + len, iov[i].iov_base, iov[i].iov_len);
+    len += iov[i].iov_len;
+  }
+
+  return irc_send(buf, len);
+}
+
+static ssize_t irc_recv(void *buf, size_t len) {
+  int n;
+
+  if(!tls) return read(irc_fd, buf, len);
+
+  n = SSL_read(tls, buf, len);
+  return n > 0 ? n : -1;
+}
+
+/* read what's waiting on fd and pass each complete line to fn; returns the
+ * number of lines, or -1 once the other end has gone (after passing on any
+ * unterminated line it left) */
+static int read_lines(int fd, struct linebuf *lb, void (*fn)(char *)) {
+  char *line, *end;
+  ssize_t n;
+  int lines = 0;
+
+  n = read(fd, lb->buf + lb->len, sizeof(lb->buf) - 1 - lb->len);
+  if(n == -1 && (errno == EAGAIN || errno == EINTR)) return 0;
+  if(n <= 0) {
+    if(lb->len) {
+      lb->buf[lb->len] = '\0';
+      fn(lb->buf);
+      lb->len = 0;
+    }
+    return -1;
+  }
+
+  lb->len += n;
+  line = lb->buf;
+  while((end = memchr(line, '\n', lb->buf + lb->len - line))) {
+    *end = '\0';
+    fn(line);
+    line = end + 1;
+    lines++;
+  }
+
+  lb->len -= line - lb->buf;
+  memmove(lb->buf, line, lb->len);
+
+  /* a line too long for the buffer goes out in pieces */
+  if(lb->len == sizeof(lb->buf) - 1) {
+    lb->buf[lb->len] = '\0';
+    fn(lb->buf);
+    lb->len = 0;
+    lines++;
+  }
+
+  return lines;
+}
+
+static void safe_print(char c, const char *text) {
+  const char *p;
+
+  printf("%c ", c);
+
+  for(p = text; *p; p++) {
+    if(isprint(*p)) putchar(*p);
+    else printf("\\x%02x", *p);
+  }
+
+  putchar('\n');
+}
+
+static ssize_t irc_write(const char *text) {
+  struct iovec iov[2];
+
+  if(verbose > IRC_MSG) safe_print('>', text);
+
+  iov[0].iov_base = (void *)text;
+  iov[0].iov_len = strlen(text);
+  iov[1].iov_base = "\r\n";
+  iov[1].iov_len = 2;
+
+  return irc_sendv(iov, 2);
+}
+
+/* what a line of this kind to t starts with: its PRIVMSG or NOTICE head,
+ * or nothing for a command */
+static const char *target_head(const struct target *t, int kind,
+                               size_t *len) {
+  if(kind == MSG_COMMAND) {
+    *len = 0;
+    return "";
+  }
+  if(kind == MSG_NOTICE) {
+    *len = t->noticelen;
+    return t->notice;
+  }
+
+  *len = t->headlen;
+  return t->head;
+}
+
+/* a queued line is sent as its target's head, its text and CRLF, without
+ * being formatted or copied on the way */
+static ssize_t irc_write_msg(const struct msg *m) {
+  char line[BUFLEN];
+  struct iovec iov[3];
+  const char *head;
+  size_t headlen;
+
+  head = target_head(m->to, m->kind, &headlen);
+  if(verbose > IRC_MSG) {
+    snprintf(line, BUFLEN, "%s%s", head, m->text);
+    safe_print('>', line);
+  }
+
+  iov[0].iov_base = (void *)head;
+  iov[0].iov_len = headlen;
+  iov[1].iov_base = (void *)m->text;
+  iov[1].iov_len = m->len;
+  iov[2].iov_base = "\r\n";
+  iov[2].iov_len = 2;
+
+  if(irc_fd != -1 && !tls && uring_fd != -1) return uring_write(iov, 3, 0);
+
+  return irc_sendv(iov, 3);
+}
+
+static unsigned long msg_count(struct msg *m) {
+  unsigned long n = 0;
+
+  for(; m; m = m->next)
+    n++;
+
+  return n;
+}
+
+static int is_channel(const char *name) {
+  return strchr("#&+!", name[0]) != NULL;
+}
+
+static struct target *target_find(const char *name) {
+  struct target *t;
+
+  for(t = targets; t; t = t->next)
+    if(strcasecmp(t->name, name) == 0) return t;
+
+  return NULL;
+}
+
+/* its share of the turns, from -W */
+static void target_weigh(struct target *t) {
+  int i;
+
+  t->quantum = 1;
+  for(i = 0; i < nweights; i++)
+    if(strncasecmp(weights[i].name, t->name, weights[i].namelen) == 0
+       && !t->name[weights[i].namelen])
+      t->quantum = weights[i].weight;
+}
+
+static struct target *target_get(const char *name) {
+  struct target *t, **end;
+
+  if((t = target_find(name))) return t;
+
+  if(!(t = calloc(1, sizeof(*t)))) {
+    perror("fifoirc: malloc");
+    return NULL;
+  }
+  snprintf(t->name, TARGETLEN, "%s", name);
+  t->headlen = snprintf(t->head, sizeof(t->head), "PRIVMSG %s :", t->name);
+  t->noticelen = snprintf(t->notice, sizeof(t->notice), "NOTICE %s :",
+                          t->name);
+  t->joined = !is_channel(name);
+  t->used = now_ms();
+  target_weigh(t);
+
+  for(end = &targets; *end; end = &(*end)->next);
+  *end = t;
+  ntargets++;
+
+  return t;
+}
+
+static struct msg *msg_alloc(void) {
+  struct msg *m;
+  int i;
+
+  if(!msg_pool) {
+    if(!(m = malloc(MSG_SLAB * sizeof(*m)))) {
+      perror("fifoirc: malloc");
+      return NULL;
+    }
+    for(i = 0; i < MSG_SLAB; i++) {
+      m[i].next = msg_pool;
+      msg_pool = &m[i];
+    }
+    msg_slabs++;
+  }
+
+  m = msg_pool;
+  msg_pool = m->next;
+  if(++msgs_used > msgs_hiwat) msgs_hiwat = msgs_used;
+
+  return m;
+}
+
+static void msg_free(struct msg *m) {
+  m->next = msg_pool;
+  msg_pool = m;
+  msgs_used--;
+}
+
+static struct msg *target_pop(struct target *t, int lane) {
+  struct lane *q = &t->lane[lane];
+  struct msg *m = q->head;
+
+  q->head = m->next;
+  if(!q->head) q->tail = NULL;
+  q->len--;
+  t->len--;
+  queue_len--;
+  m->next = NULL;
+
+  return m;
+}
+
+/* throw away everything waiting for t */
+static void target_drop(struct target *t) {
+  int lane;
+
+  lines_lost += t->len;
+  for(lane = 0; lane < NLANES; lane++)
+    while(t->lane[lane].head) msg_free(target_pop(t, lane));
+}
+
+static void queue_push(struct target *t, int lane, int kind,
+                       const char *text, size_t len) {
+  struct target *longest = t, *u;
+  struct lane *q = &t->lane[lane];
+  struct msg *m;
+
+  /* while we're not connected the queues could grow without end, so past
+   * the limit the oldest lines of the longest queue make way, bulk first */
+  if(queue_len >= spool_max) {
+    for(u = targets; u; u = u->next)
+      if(u->len > longest->len) longest = u;
+    if(longest->len) {
+      msg_free(target_pop(longest, longest->lane[LANE_BULK].len
+                                   ? LANE_BULK : LANE_URGENT));
+      lines_lost++;
+    }
+  }
+
+  if(!(m = msg_alloc())) {
+    lines_lost++;
+    return;
+  }
+
+  m->next = NULL;
+  m->to = t;
+  m->lane = lane;
+  m->kind = kind;
+  m->queued = t->used = now_ms();
+  if(len >= MSGLEN) len = MSGLEN - 1;
+  memcpy(m->text, text, len);
+  m->text[len] = '\0';
+  m->len = len;
+
+  if(q->tail) q->tail->next = m;
+  else q->head = m;
+  q->tail = m;
+  q->len++;
+  t->len++;
+  queue_len++;
+}
+
+/* the server has everything up to and including the fence; with
+ * echo-message, anything that wasn't echoed by now was rejected */
+static void confirm_fence(unsigned long seq) {
+  struct msg *m;
+  size_t len;
+
+  while((m = sent_head) && m->seq <= seq) {
+    sent_head = m->next;
+    if(!sent_head) sent_tail = NULL;
+
+    /* commands aren't echoed, so the fence is all there is */
+    if(caps[CAP_ECHO_MESSAGE].enabled && m->kind != MSG_COMMAND) {
+      fprintf(stderr, "fifoirc: server rejected: %s%s\n",
+              target_head(m->to, m->kind, &len), m->text);
+      lines_lost++;
+    } else {
+      lines_confirmed++;
+    }
+    msg_free(m);
+  }
+}
+
+/* the server echoed one of our lines back */
+static void confirm_echo(int kind, const char *target, const char *text) {
+  struct msg *m, *prev = NULL;
+
+  for(m = sent_head; m; prev = m, m = m->next) {
+    if(m->kind != kind || strcmp(m->text, text) != 0
+       || strcasecmp(m->to->name, target) != 0)
+      continue;
+
+    if(prev) prev->next = m->next;
+    else sent_head = m->next;
+    if(sent_tail == m) sent_tail = prev;
+
+    lines_confirmed++;
+    msg_free(m);
+    return;
+  }
+}
+
+/* with -l, how long until the server will take another line without
+ * counting it as flooding */
+static long long flood_wait(long long now) {
+  if(!flood_interval) return 0;
+  if(flood_tat < now) flood_tat = now;
+
+  return flood_tat - flood_interval * (flood_burst - 1) - now;
+}
+
+/* the server counts every line we send, not just the ones we queued */
+static void flood_charge(void) {
+  if(!flood_interval) return;
+  flood_wait(now_ms());
+  flood_tat += flood_interval;
+}
+
+static void target_join(struct target *t) {
+  char msg[BUFLEN];
+
+  if(t->joined || t->joining) return;
+
+  snprintf(msg, BUFLEN, "JOIN %s", t->name);
+  irc_write(msg);
+  flood_charge();
+  t->joining = 1;
+  t->ours = 1;
+}
+
+static void target_next(void) {
+  cur_target->turn = 0;
+  cur_target = cur_target->next ? cur_target->next : targets;
+}
+
+static void queue_send(struct target *t, int lane) {
+  long long now = now_ms();
+  struct msg *m;
+  size_t n;
+  char *p;
+
+  if(!delivered && verbose > INFO)
+    printf(" -- first message %lld ms after connecting\n", now - connect_ms);
+  delivered = 1;
+
+  /* numbered as they're sent, as targets don't send in the order lines
+   * were queued, and the fence covers what was sent before it */
+  m = target_pop(t, lane);
+  m->seq = next_seq++;
+  irc_write_msg(m);
+
+  /* a /join of the channel itself, so target_join() needn't send another */
+  if(m->kind == MSG_COMMAND && strncmp(m->text, "JOIN ", 5) == 0) {
+    p = m->text + 5 + strspn(m->text + 5, " ");
+    n = strlen(t->name);
+    if(strncasecmp(p, t->name, n) == 0 && (!p[n] || p[n] == ' '))
+      t->joining = !t->joined;
+  }
+  lines_sent++;
+  t->sent++;
+  flood_charge();
+
+  lane_lines[lane]++;
+  lane_wait[lane] += now - m->queued;
+  if(now - m->queued > lane_worst[lane]) lane_worst[lane] = now - m->queued;
+
+  if(sent_tail) sent_tail->next = m;
+  else sent_head = m;
+  sent_tail = m;
+}
+
+/* can we send t's next line in the lane, and if not, are we doing something
+ * about it? a -S command naming a channel doesn't need it joined */
+static int target_ready(struct target *t, int lane) {
+  if(t->lane[lane].head->kind == MSG_COMMAND) return 1;
+  if(!t->joined) target_join(t);
+
+  return t->joined;
+}
+
+/* a PING after what we've sent tells us when the server has got that far;
+ * it takes the place of a line under -l, so while lines are still waiting
+ * one goes only every FENCE_INTERVAL */
+static void queue_fence(void) {
+  char msg[BUFLEN];
+
+  if(!sent_tail || fence_seq || flood_wait(now_ms()) > 0) return;
+  if(queue_len && now_ms() < fence_ms + FENCE_INTERVAL) return;
+
+  fence_seq = sent_tail->seq;
+  fence_ms = now_ms();
+  snprintf(msg, BUFLEN, "PING :fifoirc-%lu", fence_seq);
+  irc_write(msg);
+  flood_charge();
+}
+
+/* urgent lines go first, a line from each target in turn; then bulk lines
+ * by deficit round robin: each target in turn may send its quantum of lines
+ * (more for those given a weight with -W), so a busy one can't starve the
+ * rest; lines rather than bytes because that's what the server counts when
+ * deciding whether we're flooding, and flood control may stop us part way
+ * through a turn, in which case we carry on from there next time */
+static void queue_flush(void) {
+  struct target *t;
+  int idle;
+
+  if(irc_state != IRC_JOINED) return;
+
+  queue_fence();
+
+  for(idle = 0; targets && idle < ntargets && flood_wait(now_ms()) <= 0;) {
+    t = cur_urgent ? cur_urgent : targets;
+    cur_urgent = t->next;
+    if(t->lane[LANE_URGENT].head && target_ready(t, LANE_URGENT)) {
+      queue_send(t, LANE_URGENT);
+      idle = 0;
+    } else {
+      idle++;
+    }
+  }
+
+  if(!cur_target) cur_target = targets;
+
+  for(idle = 0; cur_target && idle < ntargets && flood_wait(now_ms()) <= 0;) {
+    t = cur_target;
+    if(!t->lane[LANE_BULK].head || !target_ready(t, LANE_BULK)) {
+      t->deficit = 0;
+      target_next();
+      idle++;
+      continue;
+    }
+
+    if(!t->turn) {
+      t->deficit += t->quantum;
+      t->turn = 1;
+    }
+
+    if(!t->deficit) {
+      target_next();
+      continue;
+    }
+
+    queue_send(t, LANE_BULK);
+    t->deficit--;
+    if(!t->lane[LANE_BULK].head) t->deficit = 0;
+    idle = 0;
+  }
+
+  queue_fence();
+}
+
+/* put what the server may not have seen back at the front of each queue, in
+ * the order it was first sent */
+static void queue_requeue(void) {
+  struct target *t;
+  struct lane *q;
+  struct msg *m;
+  int lane;
+
+  while((m = sent_head)) {
+    sent_head = m->next;
+    t = m->to;
+    q = &t->lane[m->lane];
+
+    if(q->requeued) {
+      m->next = q->requeued->next;
+      q->requeued->next = m;
+    } else {
+      m->next = q->head;
+      q->head = m;
+    }
+    if(!m->next) q->tail = m;
+    q->requeued = m;
+    q->len++;
+    t->len++;
+    queue_len++;
+    lines_retried++;
+  }
+  sent_tail = NULL;
+
+  for(t = targets; t; t = t->next) {
+    for(lane = 0; lane < NLANES; lane++)
+      t->lane[lane].requeued = NULL;
+    /* channels have to be joined again */
+    t->joined = !is_channel(t->name);
+    t->joining = 0;
+  }
+}
+
+static void irc_disconnect(void);
+
+static void irc_connect(void) {
+  irc_state = IRC_CONNECTING;
+  connect_ms = now_ms();
+  connect_deadline = connect_ms + CONNECT_TIMEOUT;
+  delivered = 0;
+  identify_deadline = 0;
+  irc_buflen = 0;
+
+  irc_fd = make_tcp(server, port);
+  if(irc_fd == -1) {
+    irc_disconnect();
+    return;
+  }
+
+  irc_events = POLLOUT;
+}
+
+static void irc_register(void) {
+  char msg[BUFLEN];
+  int i;
+
+  /* everything else waits for RPL_WELCOME */
+  irc_state = IRC_REGISTERING;
+  sasl_done = 0;
+  for(i = 0; i < NCAPS; i++)
+    caps[i].offered = caps[i].enabled = 0;
+
+  /* servers that know CAP hold registration until CAP END; the rest just
+   * ignore or reject it */
+  irc_write("CAP LS 302");
+
+  snprintf(msg, BUFLEN, "NICK %s", nickname);
+  irc_write(msg);
+
+  snprintf(msg, BUFLEN, "USER %s localhost %s :%s",
+           nickname, server, fullname);
+  irc_write(msg);
+
+  recv_ms = now_ms();
+  ping_sent = 0;
+}
+
+/* called when poll() has news about a connection in progress: finish the
+ * TCP connection, then the TLS handshake, then start registering */
+static void irc_connecting(void) {
+  socklen_t len;
+  int err, n;
+
+  if(!tls) {
+    len = sizeof(err);
+    if(getsockopt(irc_fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) err = errno;
+    if(err) {
+      fprintf(stderr, "fifoirc: connect %s: %s\n", server, strerror(err));
+      irc_disconnect();
+      return;
+    }
+
+    if(verbose > INFO) printf(" -- connected to %s:%hu\n", server, port);
+
+    if(use_tls && tls_start(irc_fd) == -1) {
+      irc_disconnect();
+      return;
+    }
+  }
+
+  if(tls) {
+    if((n = SSL_connect(tls)) != 1) {
+      switch(SSL_get_error(tls, n)) {
+      case SSL_ERROR_WANT_READ:  irc_events = POLLIN;  return;
+      case SSL_ERROR_WANT_WRITE: irc_events = POLLOUT; return;
+      }
+
+      tls_perror("SSL_connect");
+      irc_disconnect();
+      return;
+    }
+
+    if(verbose > INFO)
+      printf(" -- %s with %s, session %s\n", SSL_get_version(tls),
+             SSL_get_cipher(tls), SSL_session_reused(tls) ? "resumed" : "new");
+  }
+
+  /* everything from here on expects a blocking socket */
+  fcntl(irc_fd, F_SETFL, fcntl(irc_fd, F_GETFL) & ~O_NONBLOCK);
+
+  irc_register();
+}
+
+static void irc_identified(void) {
+  char msg[BUFLEN];
+
+  irc_state = IRC_IDENTIFIED;
+  identify_deadline = 0;
+
+  if(verbose > INFO)
+    printf(" -- registered %lld ms after connecting\n", now_ms() - connect_ms);
+
+  snprintf(msg, BUFLEN, "JOIN %s", channel);
+  irc_write(msg);
+}
+
+static void irc_joined(void) {
+  struct target *t;
+
+  if((t = target_get(channel))) t->joined = 1;
+  irc_state = IRC_JOINED;
+  backoff = BACKOFF_MIN;
+
+  if(verbose > INFO)
+    printf(" -- joined %s %lld ms after connecting\n", channel,
+           now_ms() - connect_ms);
+
+  queue_flush();
+}
+
+static int sasl_wanted(void) {
+  return nspasswd || tls_cert;
+}
+
+/* look for a capability in a space-separated list like "sasl=PLAIN foo" */
+static int cap_listed(const char *list, const char *name) {
+  size_t len = strlen(name);
+  const char *p;
+
+  for(p = list; (p = strstr(p, name)); p += len) {
+    if((p == list || p[-1] == ' ') && strchr(" =", p[len]))
+      return 1;
+  }
+
+  return 0;
+}
+
+static void cap_request(void) {
+  char msg[BUFLEN];
+  int i, n;
+
+  n = snprintf(msg, BUFLEN, "CAP REQ :");
+  for(i = 0; i < NCAPS; i++) {
+    if(!caps[i].offered) continue;
+    if(i == CAP_SASL && !sasl_wanted()) continue;
+    n += snprintf(msg + n, BUFLEN - n, "%s ", caps[i].name);
+  }
+
+  if(msg[n - 1] == ':') {
+    irc_write("CAP END");
+  } else {
+    msg[n - 1] = '\0';
+    irc_write(msg);
+  }
+}
+
+/* args is "<nick> <subcommand> [*] :<capabilities>" */
+static void irc_cap(char *args) {
+  char *sub, *more, *list;
+  int i;
+
+  if(!(sub = strchr(args, ' '))) return;
+  sub++;
+  if(!(list = strchr(sub, ':'))) return;
+  list++;
+  more = strstr(sub, " * ");
+
+  if(strncmp(sub, "LS ", 3) == 0) {
+    for(i = 0; i < NCAPS; i++)
+      if(cap_listed(list, caps[i].name)) caps[i].offered = 1;
+
+    /* a multi-line reply has a '*' before the list on all but the last */
+    if(!more || more > list) cap_request();
+  } else if(strncmp(sub, "ACK ", 4) == 0) {
+    for(i = 0; i < NCAPS; i++)
+      if(cap_listed(list, caps[i].name)) caps[i].enabled = 1;
+
+    if(caps[CAP_SASL].enabled && !sasl_done)
+      irc_write(tls_cert ? "AUTHENTICATE EXTERNAL" : "AUTHENTICATE PLAIN");
+    else
+      irc_write("CAP END");
+  } else if(strncmp(sub, "NAK ", 4) == 0) {
+    irc_write("CAP END");
+  }
+}
+
+/* the server is ready for our SASL credentials */
+static void irc_authenticate(void) {
+  char creds[BUFLEN];
+  char msg[BUFLEN];
+  unsigned char b64[BUFLEN * 2];
+  int len, n;
+
+  if(tls_cert) {
+    irc_write("AUTHENTICATE +");
+    return;
+  }
+
+  len = snprintf(creds, BUFLEN, "%s%c%s%c%s", nickname, 0, nickname, 0,
+                 nspasswd);
+  len = EVP_EncodeBlock(b64, (unsigned char *)creds, len);
+  memset(creds, 0, sizeof(creds));
+
+  /* at most 400 bytes go in each AUTHENTICATE, and a final chunk of exactly
+   * 400 has to be followed by an empty one */
+  for(n = 0; n < len; n += 400) {
+    snprintf(msg, BUFLEN, "AUTHENTICATE %.400s", b64 + n);
+    irc_write(msg);
+  }
+  if(len % 400 == 0) irc_write("AUTHENTICATE +");
+}
+
+/* the replies saying we can't join a channel */
+static int is_join_error(const char *cmd) {
+  return strcmp(cmd, "403") == 0 || strcmp(cmd, "405") == 0
+         || strcmp(cmd, "471") == 0 || strcmp(cmd, "473") == 0
+         || strcmp(cmd, "474") == 0 || strcmp(cmd, "475") == 0
+         || strcmp(cmd, "477") == 0;
+}
+
+/* move through the connection states based on what the server said */
+static void irc_progress(const char *prefix, const char *cmd, char *args) {
+  char msg[BUFLEN];
+  char *p;
+
+  if(irc_state == IRC_REGISTERING) {
+    if(strcmp(cmd, "CAP") == 0) {
+      irc_cap(args);
+    } else if(strcmp(cmd, "903") == 0) {/* RPL_SASLSUCCESS */
+      if(verbose > INFO) printf(" -- authenticated with SASL\n");
+      sasl_done = 1;
+      irc_write("CAP END");
+    } else if(strcmp(cmd, "902") == 0 || strcmp(cmd, "904") == 0
+              || strcmp(cmd, "905") == 0 || strcmp(cmd, "906") == 0) {
+      fprintf(stderr, "fifoirc: SASL authentication failed (%s)\n", cmd);
+      irc_write("CAP END");
+    } else if(strcmp(cmd, "001") == 0) {/* RPL_WELCOME */
+      if(!nspasswd || sasl_done) {
+        irc_identified();
+        return;
+      }
+
+      snprintf(msg, BUFLEN, "PRIVMSG NickServ :identify %s %s",
+               nickname, nspasswd);
+      irc_write(msg);
+      identify_deadline = now_ms() + IDENTIFY_TIMEOUT;
+    } else if(identify_deadline
+              && (strcmp(cmd, "900") == 0/* RPL_LOGGEDIN */
+                  || (strcmp(cmd, "NOTICE") == 0
+                      && strncasecmp(prefix, "NickServ!", 9) == 0))) {
+      irc_identified();
+    }
+  } else if(irc_state == IRC_IDENTIFIED) {
+    /* the channel is the second argument of RPL_ENDOFNAMES and of the
+     * errors saying we can't join; in the latter case carry on anyway, as
+     * we always used to, and let the server reject what it must */
+    if((p = strchr(args, ' '))) args = p + 1;
+    if((p = strchr(args, ' '))) *p = '\0';
+    if(strcasecmp(args, channel) != 0) return;
+
+    if(strcmp(cmd, "366") == 0) {
+      irc_joined();
+    } else if(is_join_error(cmd)) {
+      fprintf(stderr, "fifoirc: can't join %s (%s)\n", channel, cmd);
+      irc_joined();
+    }
+  }
+}
+
+static void print_stats(void) {
+  struct target *t;
+  struct child *ch;
+  int i;
+
+  if(verbose <= INFO) return;
+
+  printf(" -- %lu lines sent, %lu confirmed, %lu unconfirmed, %lu retried, "
+         "%lu lost\n", lines_sent, lines_confirmed, msg_count(sent_head),
+         lines_retried, lines_lost);
+  if(dedup_window)
+    printf(" -- %lu repeated lines held back\n", lines_repeated);
+  if(raw_fifo)
+    printf(" -- %lu raw lines passed through, %lu dropped\n", raw_lines,
+           raw_dropped);
+  printf(" -- %lu lines held at most, in %lu slabs of %d\n", msgs_hiwat,
+         msg_slabs, MSG_SLAB);
+  if(uring_fd != -1)
+    printf(" -- %lu calls to io_uring_enter()\n", uring_enters);
+
+  for(i = 0; program && i < nchildren; i++) {
+    ch = &children[i];
+    printf(" -- child %d (pid %d): %lu lines in, %lu out, %lu dropped, "
+           "%d bytes queued\n", i, (int)ch->pid, ch->sent, ch->replies,
+           ch->dropped, ch->fd == -1 ? 0 : child_backlog(ch));
+  }
+
+  for(t = targets; t; t = t->next)
+    printf(" -- %s: %lu lines sent, %lu waiting\n", t->name, t->sent, t->len);
+
+  for(i = 0; i < NLANES; i++)
+    if(lane_lines[i])
+      printf(" -- %s lines waited %lld ms on average, %lld ms at worst\n",
+             lane_names[i], lane_wait[i] / lane_lines[i], lane_worst[i]);
+
+  for(i = 0; i < nwriters; i++)
+    printf(" -- writer pid %d (uid %d): %lu lines\n", (int)writers[i].pid,
+           (int)writers[i].uid, writers[i].lines);
+}
+
+/* drop the connection (or the attempt at one) and, with -r, schedule the
+ * next attempt on the next server in the list */
+static void irc_disconnect(void) {
+  long long delay;
+
+  if(tls) {
+    SSL_free(tls);
+    tls = NULL;
+  }
+
+  if(irc_fd != -1) {
+    uring_cancel_writes();
+    fd_close(irc_fd);
+    irc_fd = -1;
+
+    if(irc_state != IRC_CONNECTING) {
+      fprintf(stderr, "fifoirc: disconnection from %s\n", server);
+      print_stats();
+    }
+  }
+
+  /* the server may or may not have seen what's unconfirmed, so send it
+   * again rather than risk losing it */
+  fence_seq = 0;
+  queue_requeue();
+  irc_state = IRC_CONNECTING;
+
+  if(!reconnect) {
+    lines_lost += queue_len;
+    print_stats();
+    exit(EXIT_FAILURE);
+  }
+
+  /* wait somewhere between half and all of the backoff, so that lots of us
+   * dropped at once don't all come back at once */
+  delay = backoff / 2 + random() % (backoff / 2 + 1);
+  reconnect_at = now_ms() + delay;
+  backoff *= 2;
+  if(backoff > BACKOFF_MAX) backoff = BACKOFF_MAX;
+
+  cur_server = (cur_server + 1) % nservers;
+  server = servers[cur_server];
+
+  if(verbose > INFO)
+    printf(" -- reconnecting to %s in %lld ms\n", server, delay);
+}
+
+/* copy the nick out of a "nick!user@host" prefix */
+static void prefix_nick(char *nick, const char *prefix) {
+  size_t len = strcspn(prefix, "!@");
+
+  if(len >= NICKLEN) len = NICKLEN - 1;
+  memcpy(nick, prefix, len);
+  nick[len] = '\0';
+}
+
+/* copy the nth argument (from 0) of args, without any leading colon */
+static void irc_arg(char *out, size_t size, const char *args, int n) {
+  size_t len;
+
+  while(n-- && (args = strchr(args, ' '))) args++;
+  if(!args) args = "";
+  if(args[0] == ':') args++;
+
+  len = strcspn(args, " ");
+  if(len >= size) len = size - 1;
+  memcpy(out, args, len);
+  out[len] = '\0';
+}
+
+/* append the n bytes at s to buf as a JSON string, as much as fits */
+static size_t json_quote(char *buf, size_t len, size_t size, const char *s,
+                         size_t n) {
+  const char *end = s + n;
+  unsigned char c;
+
+  if(len + 2 > size) return len;
+  buf[len++] = '"';
+
+  for(; s < end && len + 8 < size; s++) {
+    c = *s;
+    if(c == '"' || c == '\\') {
+      buf[len++] = '\\';
+      buf[len++] = c;
+    } else if(c < 0x20) {
+      len += sprintf(buf + len, "\\u%04x", c);
+    } else {
+      buf[len++] = c;
+    }
+  }
+
+  buf[len++] = '"';
+
+  return len;
+}
+
+/* undo IRCv3 tag value escaping in place */
+static size_t tag_unescape(char *s, size_t n) {
+  char *in, *out = s, *end = s + n;
+
+  for(in = s; in < end; in++) {
+    if(*in != '\\') {
+      *out++ = *in;
+      continue;
+    }
+    if(++in == end) break;
+    switch(*in) {
+    case ':': *out++ = ';';  break;
+    case 's': *out++ = ' ';  break;
+    case 'r': *out++ = '\r'; break;
+    case 'n': *out++ = '\n'; break;
+    default:  *out++ = *in;  break;
+    }
+  }
+
+  return out - s;
+}
+
+/* append the literal s to buf if it fits */
+static size_t json_lit(char *buf, size_t len, size_t size, const char *s) {
+  size_t n = strlen(s);
+
+  if(len + n >= size) return len;
+  memcpy(buf + len, s, n + 1);
+
+  return len + n;
+}
+
+/* hand a PRIVMSG to the program as a line of JSON:
+ *  {"time":...,"from":...,"nick":...,"target":...,"text":...,"tags":{...}}
+ * the time is the server's if it sent one (server-time), otherwise ours */
+static void program_json(char *tags, const char *prefix, const char *target,
+                         const char *text) {
+  char buf[8 * BUFLEN];
+  char stamp[32];
+  char nick[NICKLEN];
+  const char *time = NULL;
+  char *tag, *value, *end = tags + strlen(tags);
+  size_t len = 0, n, size = sizeof(buf) - 3;
+  struct timespec ts;
+  struct tm tm;
+
+  prefix_nick(nick, prefix);
+
+  for(tag = tags; tag < end; tag += n + 1) {
+    n = strcspn(tag, ";");
+    tag[n] = '\0';
+    if(strncmp(tag, "time=", 5) == 0) time = tag + 5;
+  }
+
+  if(!time) {
+    clock_gettime(CLOCK_REALTIME, &ts);
+    gmtime_r(&ts.tv_sec, &tm);
+    n = strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(stamp + n, sizeof(stamp) - n, ".%03ldZ", ts.tv_nsec / 1000000);
+    time = stamp;
+  }
+
+  len = json_lit(buf, len, size, "{\"time\":");
+  len = json_quote(buf, len, size, time, strlen(time));
+  len = json_lit(buf, len, size, ",\"from\":");
+  len = json_quote(buf, len, size, prefix, strlen(prefix));
+  len = json_lit(buf, len, size, ",\"nick\":");
+  len = json_quote(buf, len, size, nick, strlen(nick));
+  len = json_lit(buf, len, size, ",\"target\":");
+  len = json_quote(buf, len, size, target, strcspn(target, " "));
+  len = json_lit(buf, len, size, ",\"text\":");
+  len = json_quote(buf, len, size, text, strlen(text));
+  len = json_lit(buf, len, size, ",\"tags\":{");
+
+  /* the tags were split at their semicolons above */
+  for(tag = tags; tag < end; tag += n + 1) {
+    n = strlen(tag);
+    if(tag != tags) len = json_lit(buf, len, size, ",");
+    if((value = strchr(tag, '='))) {
+      len = json_quote(buf, len, size, tag, value - tag);
+      len = json_lit(buf, len, size, ":");
+      value++;
+      len = json_quote(buf, len, size, value,
+                       tag_unescape(value, tag + n - value));
+    } else {
+      len = json_quote(buf, len, size, tag, n);
+      len = json_lit(buf, len, size, ":true");
+    }
+  }
+
+  memcpy(buf + len, "}}\n", 4);
+
+  program_write(buf);
+}
+
+static void irc_line(char *line) {
+  char msg[BUFLEN];
+  char nick[NICKLEN];
+  char *endline;
+  char name[TARGETLEN];
+  char *tags = "", *prefix = "", *cmd, *args;
+  struct target *t;
+  char *p;
+
+  if((endline = strpbrk(line, "\r\n"))) *endline = '\0';
+
+  if(verbose > IRC_MSG) safe_print('<', line);
+
+  /* [@tags] [:prefix] command args */
+  if(line[0] == '@') {
+    tags = line + 1;
+    if(!(line = strchr(line, ' '))) return;
+    *line++ = '\0';
+  }
+  if(line[0] == ':') {
+    prefix = line + 1;
+    if(!(line = strchr(line, ' '))) return;
+    *line++ = '\0';
+  }
+  cmd = line;
+  if((args = strchr(line, ' '))) *args++ = '\0';
+  else args = "";
+
+  if(strcmp(cmd, "PING") == 0) {
+    snprintf(msg, BUFLEN, "PONG %s", args);
+    irc_write(msg);
+    return;
+  }
+
+  if(strcmp(cmd, "AUTHENTICATE") == 0 && strcmp(args, "+") == 0)
+    irc_authenticate();
+
+  if(strcmp(cmd, "001") == 0) {/* the first argument is the nick we got */
+    snprintf(cur_nick, NICKLEN, "%.*s", (int)strcspn(args, " "), args);
+  } else if(strcmp(cmd, "NICK") == 0) {
+    prefix_nick(nick, prefix);
+    if(strcasecmp(nick, cur_nick) == 0)
+      snprintf(cur_nick, NICKLEN, "%s", args + (args[0] == ':'));
+  }
+
+  if(irc_state != IRC_JOINED) {
+    snprintf(msg, BUFLEN, "%s", args);
+    irc_progress(prefix, cmd, msg);
+  }
+
+  if(strcmp(cmd, "PRIVMSG") == 0) {
+    if(!(p = strchr(args, ':'))) return;
+
+    /* with echo-message the server repeats what we sent once it has been
+     * accepted; count it, and don't feed it back to the program */
+    prefix_nick(nick, prefix);
+    if(strcasecmp(nick, cur_nick) == 0) {
+      irc_arg(msg, BUFLEN, args, 0);
+      confirm_echo(MSG_PRIVMSG, msg, p + 1);
+      return;
+    }
+
+    if(json_mode) {
+      program_json(tags, prefix, args, p + 1);
+    } else {
+      snprintf(msg, BUFLEN, "%s\n", p + 1);
+      program_write(msg);
+    }
+
+    /* handle ctcp version */
+    if(strcmp(p, ":\x01VERSION\x01") == 0) {
+      snprintf(msg, BUFLEN, "NOTICE %s :\x01VERSION fifoirc\x01", nick);
+      irc_write(msg);
+    }
+  } else if(strcmp(cmd, "NOTICE") == 0) {
+    /* our own, from -S, echoed back */
+    prefix_nick(nick, prefix);
+    if(strcasecmp(nick, cur_nick) == 0 && (p = strchr(args, ':'))) {
+      irc_arg(msg, BUFLEN, args, 0);
+      confirm_echo(MSG_NOTICE, msg, p + 1);
+    }
+  } else if(strcmp(cmd, "PONG") == 0) {
+    /* our token comes back as the last parameter, which not every server
+     * puts after a colon */
+    irc_arg(msg, BUFLEN, args, 1);
+    if(!msg[0]) irc_arg(msg, BUFLEN, args, 0);
+    if(strncmp(msg, "fifoirc-", 8) == 0) {
+      confirm_fence(strtoul(msg + 8, NULL, 10));
+      fence_seq = 0;
+      queue_flush();/* sends the next fence if there's more to confirm */
+    }
+  } else if(strcmp(cmd, "JOIN") == 0 || strcmp(cmd, "PART") == 0
+            || strcmp(cmd, "KICK") == 0) {
+    /* keep track of which channels we can send to */
+    if(strcmp(cmd, "KICK") == 0) irc_arg(nick, NICKLEN, args, 1);
+    else prefix_nick(nick, prefix);
+    irc_arg(name, TARGETLEN, args, 0);
+    if(strcasecmp(nick, cur_nick) != 0 || !(t = target_find(name))) return;
+
+    t->joined = strcmp(cmd, "JOIN") == 0;
+    t->joining = 0;
+    queue_flush();
+  } else if(irc_state == IRC_JOINED && is_join_error(cmd)) {
+    irc_arg(name, TARGETLEN, args, 1);
+    if(!(t = target_find(name)) || !t->joining) return;
+
+    fprintf(stderr, "fifoirc: can't join %s (%s), dropping %lu lines\n",
+            t->name, cmd, t->len);
+    target_drop(t);
+    t->joining = 0;
+  } else if(strcmp(cmd, "BATCH") == 0) {
+    /* nothing we send is answered with a batch, and messages inside one are
+     * handled as they come, so just keep track for the verbose output */
+    if(verbose > INFO)
+      printf(" -- batch %s %s\n", args[0] == '+' ? "start" : "end", args + 1);
+  }
+}
+
+static void irc_handle(void) {
+  char *line, *endline;
+  ssize_t n;
+
+  do {
+    n = irc_recv(irc_buf + irc_buflen, BUFLEN - 1 - irc_buflen);
+    if(n <= 0) {
+      irc_disconnect();
+      return;
+    }
+
+    recv_ms = now_ms();
+    ping_sent = 0;
+
+    irc_buflen += n;
+    line = irc_buf;
+    while((endline = memchr(line, '\n', irc_buf + irc_buflen - line))) {
+      *endline = '\0';
+      irc_line(line);
+      line = endline + 1;
+    }
+
+    /* keep any partial line for next time, but a line that fills the whole
+     * buffer is never going to end, so throw it away */
+    irc_buflen -= line - irc_buf;
+    if(irc_buflen == BUFLEN - 1) irc_buflen = 0;
+    memmove(irc_buf, line, irc_buflen);
+  } while(tls && SSL_pending(tls));/* poll() can't see what OpenSSL buffered */
+}
+
+static void text_queue(struct target *t, int lane, int kind,
+                       const char *text) {
+  /* the 450-byte limit ensures that
+   *  a.) the message we send to the server will fit in IRC's 512 byte limit
+   *  b.) the message the server sends to other clients which includes our
+   *      full nick!username@host string will fit in 512 bytes
+   */
+  size_t room, len = strlen(text), n;
+
+  /* a command has been checked already, and can't be split */
+  if(kind == MSG_COMMAND) {
+    queue_push(t, lane, kind, text, len);
+    return;
+  }
+
+  target_head(t, kind, &room);
+  room = 450 - 1 - room;
+
+  /* anything too long is split over several messages */
+  do {
+    n = len < room ? len : room;
+    queue_push(t, lane, kind, text, n);
+    text += n;
+    len -= n;
+  } while(len);
+}
+
+/* FNV-1a, over the target and the text */
+static uint64_t dedup_hash(const struct target *t, const char *text) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  const char *p;
+
+  for(p = t->name; *p; p++)
+    h = (h ^ (unsigned char)tolower((unsigned char)*p)) * 0x100000001b3ULL;
+  h *= 0x100000001b3ULL;
+  for(p = text; *p; p++)
+    h = (h ^ (unsigned char)*p) * 0x100000001b3ULL;
+
+  return h;
+}
+
+/* say how many times the line in slot d was repeated, and forget it */
+static void dedup_report(struct dedup *d) {
+  char msg[BUFLEN];
+
+  if(d->repeats) {
+    snprintf(msg, BUFLEN, "%s (repeated %lu times)", d->text, d->repeats);
+    text_queue(d->to, d->lane, d->kind, msg);
+    dedup_pending--;
+  }
+
+  free(d->text);
+  memset(d, 0, sizeof(*d));
+}
+
+/* report what's due, and say when the next report will be */
+static void dedup_expire(long long now, long long *next) {
+  struct dedup *d;
+  int reported = 0;
+
+  if(!dedup_pending) return;
+
+  for(d = dedup; d < dedup + DEDUP_SIZE; d++) {
+    if(!d->repeats) continue;
+    if(now >= d->since + dedup_window) {
+      dedup_report(d);
+      reported = 1;
+    } else if(d->since + dedup_window < *next) {
+      *next = d->since + dedup_window;
+    }
+  }
+
+  if(reported) queue_flush();
+}
+
+/* let go of the targets nothing has been queued for in TARGET_IDLE, leaving
+ * the channels we joined only to send there; not the -c channel, nor one
+ * that sent lines still waiting to be confirmed or -D slots point at */
+static void target_expire(long long now, long long *next) {
+  static long long sweep_at;
+  struct target *t, **tp;
+  struct dedup *d;
+  struct msg *m;
+  char msg[BUFLEN];
+
+  if(now < sweep_at) {
+    if(sweep_at < *next) *next = sweep_at;
+    return;
+  }
+  sweep_at = now + TARGET_SWEEP;
+  if(sweep_at < *next) *next = sweep_at;
+
+  for(t = targets; t; t = t->next) t->busy = 0;
+  for(m = sent_head; m; m = m->next) m->to->busy = 1;
+  for(d = dedup; d < dedup + DEDUP_SIZE; d++) {
+    if(!d->to) continue;
+    /* a slot whose window is over with nothing to report is done with */
+    if(!d->repeats && now >= d->since + dedup_window) dedup_report(d);
+    else d->to->busy = 1;
+  }
+
+  for(tp = &targets; (t = *tp);) {
+    if(t->busy || t->len || now < t->used + TARGET_IDLE
+       || t->joining || (t->joined && is_channel(t->name) && !t->ours)
+       || strcasecmp(t->name, channel) == 0) {
+      tp = &t->next;
+      continue;
+    }
+
+    if(t->joined && is_channel(t->name)) {
+      snprintf(msg, BUFLEN, "PART %s", t->name);
+      irc_write(msg);
+      flood_charge();
+    }
+    if(verbose > INFO) printf(" -- letting go of %s\n", t->name);
+
+    *tp = t->next;
+    if(cur_target == t) cur_target = t->next;
+    if(cur_urgent == t) cur_urgent = t->next;
+    ntargets--;
+    free(t);
+  }
+}
+
+static void text_send(const char *target, int lane, int kind,
+                      const char *text) {
+  struct target *t;
+  struct dedup *d;
+  uint64_t h;
+  long long now;
+
+  if(!(t = target_get(target))) {
+    lines_lost++;
+    return;
+  }
+
+  /* "(repeated N times)" can only go after text */
+  if(dedup_window && kind != MSG_COMMAND) {
+    now = now_ms();
+    h = dedup_hash(t, text);
+    d = &dedup[h % DEDUP_SIZE];
+
+    if(d->to == t && d->kind == kind && d->hash == h
+       && now < d->since + dedup_window) {
+      if(!d->text && !(d->text = strdup(text))) return;
+      if(!d->repeats++) dedup_pending++;
+      lines_repeated++;
+      return;
+    }
+
+    dedup_report(d);
+    d->hash = h;
+    d->to = t;
+    d->lane = lane;
+    d->kind = kind;
+    d->since = now;
+  }
+
+  text_queue(t, lane, kind, text);
+}
+
+static void text_line(char *text) {
+  text_send(channel, LANE_BULK, MSG_PRIVMSG, text);
+}
+
+/* is this something we can put after PRIVMSG? */
+static int valid_target(const char *target, size_t len) {
+  return len && len < TARGETLEN && target[0] != ':'
+         && strcspn(target, " ,\t\r\n") >= len;
+}
+
+/* "target<TAB>text" sends the text somewhere other than the channel;
+ * returns how many lines were queued */
+static int route_text(char *text, int lane) {
+  const char *target = channel;
+  char *tab, *p;
+  int lines = 0;
+
+  if((tab = strchr(text, '\t')) && valid_target(text, tab - text)) {
+    *tab = '\0';
+    target = text;
+    text = tab + 1;
+  }
+
+  for(p = strtok(text, "\r\n"); p; p = strtok(NULL, "\r\n")) {
+    text_send(target, lane, MSG_PRIVMSG, p);
+    lines++;
+  }
+
+  return lines;
+}
+
+/* with -S, "/msg <target> <text>" and "/notice <target> <text>" send the
+ * text as a PRIVMSG or a NOTICE; any other command is sent as it is, in
+ * IRC's own syntax ("/topic #chan :text"), after whatever is waiting for
+ * the channel it names, or else for the channel */
+static void command_line(char *line, int lane) {
+  char target[TARGETLEN];
+  char *args, *text, *p;
+  int kind = MSG_COMMAND;
+  size_t n, len;
+
+  /* a message from a writer may end in CRLF */
+  len = strcspn(line, "\r\n");
+  if(!line[len + strspn(line + len, "\r\n")]) line[len] = '\0';
+
+  n = strcspn(line, " ");
+  for(p = line; p < line + n; p++)
+    *p = toupper((unsigned char)*p);
+  args = line + n + strspn(line + n, " ");
+  len = strcspn(args, " ");
+  text = args + len + strspn(args + len, " ");
+
+  if(n == 3 && strncmp(line, "MSG", 3) == 0) kind = MSG_PRIVMSG;
+  if(n == 6 && strncmp(line, "NOTICE", 6) == 0) kind = MSG_NOTICE;
+
+  /* the server would close the connection on us, and the QUIT, never
+   * confirmed, would go again after every reconnect; SIGTERM is the way */
+  if(n == 4 && strncmp(line, "QUIT", 4) == 0) {
+    fprintf(stderr, "fifoirc: /quit: send fifoirc SIGTERM instead\n");
+    return;
+  }
+
+  if(!n || strpbrk(line, "\r\n")
+     || (kind == MSG_COMMAND ? strlen(line) > MSGLEN - 2
+                             : !valid_target(args, len) || !*text)) {
+    fprintf(stderr, "fifoirc: bad command: /%.60s\n", line);
+    return;
+  }
+
+  snprintf(target, sizeof(target), "%.*s", (int)len, args);
+  if(kind != MSG_COMMAND)
+    text_send(target, lane, kind, text);
+  else if(valid_target(args, len) && is_channel(target))
+    text_send(target, lane, kind, line);
+  else
+    text_send(channel, lane, kind, line);
+}
+
+/* with -S, a line starting with / is a command, and one starting with //
+ * is text that starts with /; returns the text, or NULL for a command */
+static char *text_command(char *text, int lane) {
+  if(!use_commands || text[0] != '/') return text;
+  if(text[1] == '/') return text + 1;
+
+  command_line(text + 1, lane);
+  return NULL;
+}
+
+static const char *json_ws(const char *p) {
+  while(*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+
+  return p;
+}
+
+static int json_hex(const char *p, unsigned long *c) {
+  int i;
+
+  for(*c = i = 0; i < 4; i++) {
+    if(!isxdigit((unsigned char)p[i])) return -1;
+    *c = *c << 4 | (isdigit((unsigned char)p[i]) ? p[i] - '0'
+                                                  : (p[i] | 0x20) - 'a' + 10);
+  }
+
+  return 0;
+}
+
+/* decode the JSON string at p into out (if it's not NULL), returning what
+ * follows it, or NULL if it isn't one or doesn't fit */
+static const char *json_string(const char *p, char *out, size_t size) {
+  unsigned long c, lo;
+  size_t n = 0;
+
+  if(*p++ != '"') return NULL;
+
+  while(*p != '"') {
+    if(!*p) return NULL;
+
+    if(*p != '\\') {
+      c = (unsigned char)*p++;
+      if(out && n + 1 >= size) return NULL;
+      if(out) out[n] = c;
+      n++;
+      continue;
+    }
+
+    p++;
+    switch(*p++) {
+    case '"':  c = '"';  break;
+    case '\\': c = '\\'; break;
+    case '/':  c = '/';  break;
+    case 'b':  c = '\b'; break;
+    case 'f':  c = '\f'; break;
+    case 'n':  c = '\n'; break;
+    case 'r':  c = '\r'; break;
+    case 't':  c = '\t'; break;
+    case 'u':
+      if(json_hex(p, &c) == -1) return NULL;
+      p += 4;
+      /* a surrogate pair, or half of one on its own */
+      if(c >= 0xd800 && c < 0xdc00 && p[0] == '\\' && p[1] == 'u'
+         && json_hex(p + 2, &lo) == 0 && lo >= 0xdc00 && lo < 0xe000) {
+        c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+        p += 6;
+      } else if(c >= 0xd800 && c < 0xe000) {
+        c = 0xfffd;
+      }
+      break;
+    default:
+      return NULL;
+    }
+
+    if(!c) continue;/* IRC has no way to carry a NUL */
+    if(out && n + 4 >= size) return NULL;
+    if(!out) {
+      n += 4;
+    } else if(c < 0x80) {
+      out[n++] = c;
+    } else if(c < 0x800) {
+      out[n++] = 0xc0 | c >> 6;
+      out[n++] = 0x80 | (c & 0x3f);
+    } else if(c < 0x10000) {
+      out[n++] = 0xe0 | c >> 12;
+      out[n++] = 0x80 | (c >> 6 & 0x3f);
+      out[n++] = 0x80 | (c & 0x3f);
+    } else {
+      out[n++] = 0xf0 | c >> 18;
+      out[n++] = 0x80 | (c >> 12 & 0x3f);
+      out[n++] = 0x80 | (c >> 6 & 0x3f);
+      out[n++] = 0x80 | (c & 0x3f);
+    }
+  }
+
+  if(out) out[n] = '\0';
+
+  return p + 1;
+}
+
+/* skip over a JSON value of any kind */
+static const char *json_skip(const char *p) {
+  const char *start = p;
+  int depth = 0;
+
+  if(*p == '"') return json_string(p, NULL, 0);
+
+  if(*p != '{' && *p != '[') {
+    while(*p && !strchr(",}] \t\r\n", *p)) p++;
+    return p == start ? NULL : p;
+  }
+
+  do {
+    if(*p == '"') {
+      if(!(p = json_string(p, NULL, 0))) return NULL;
+      continue;
+    }
+    if(!*p) return NULL;
+    if(*p == '{' || *p == '[') depth++;
+    else if(*p == '}' || *p == ']') depth--;
+    p++;
+  } while(depth);
+
+  return p;
+}
+
+/* pick "target" and "text" out of a JSON object, ignoring anything else */
+static int json_reply(const char *p, char *target, size_t tsize, char *text,
+                      size_t size) {
+  char key[16];
+  const char *q;
+
+  p = json_ws(p);
+  if(*p++ != '{') return -1;
+  p = json_ws(p);
+  if(*p == '}') return 0;
+
+  while(1) {
+    /* a key too long to be one we want is still a key */
+    if(!(q = json_string(p, key, sizeof(key)))) {
+      key[0] = '\0';
+      q = json_string(p, NULL, 0);
+    }
+    if(!(p = q)) return -1;
+    p = json_ws(p);
+    if(*p++ != ':') return -1;
+    p = json_ws(p);
+
+    if(strcmp(key, "target") == 0 && *p == '"')
+      p = json_string(p, target, tsize);
+    else if(strcmp(key, "text") == 0 && *p == '"')
+      p = json_string(p, text, size);
+    else
+      p = json_skip(p);
+
+    if(!p) return -1;
+    p = json_ws(p);
+    if(*p == '}') return 0;
+    if(*p++ != ',') return -1;
+    p = json_ws(p);
+  }
+}
+
+/* with -T, lines from the FIFO (or the -R ring) can be routed too */
+static void fifo_line(char *text) {
+  if(!(text = text_command(text, LANE_BULK))) return;
+  if(route_fifo) route_text(text, LANE_BULK);
+  else text_line(text);
+}
+
+static void urgent_line(char *text) {
+  if(!(text = text_command(text, LANE_URGENT))) return;
+  if(route_fifo) route_text(text, LANE_URGENT);
+  else text_send(channel, LANE_URGENT, MSG_PRIVMSG, text);
+}
+
+/* with -J the program replies with JSON, which may name a target other than
+ * the channel, and may span several lines */
+static void program_line(char *line) {
+  char target[TARGETLEN];
+  char text[BUFLEN];
+  char *p;
+
+  if(!json_mode) {
+    text_line(line);
+    return;
+  }
+
+  snprintf(target, sizeof(target), "%s", channel);
+  text[0] = '\0';
+
+  if(json_reply(line, target, sizeof(target), text, sizeof(text)) == -1
+     || !valid_target(target, strlen(target))) {
+    fprintf(stderr, "fifoirc: bad reply from program: %.60s\n", line);
+    return;
+  }
+
+  for(p = strtok(text, "\r\n"); p; p = strtok(NULL, "\r\n"))
+    text_send(target, LANE_BULK, MSG_PRIVMSG, p);
+}
+
+/* read lines from the FIFO or a child and queue them for the channel */
+static int text_handle(int fd, struct linebuf *lb, void (*fn)(char *)) {
+  int n;
+
+  n = read_lines(fd, lb, fn);
+  queue_flush();
+
+  return n;
+}
+
+/* bytes still in the -a FIFO */
+static int raw_waiting(void) {
+  int n;
+
+  return raw_fd != -1 && ioctl(raw_fd, FIONREAD, &n) == 0 && n > 0;
+}
+
+/* the writer has gone; once we're shutting down, nobody else can come */
+static int raw_reopen(void) {
+  if(!shutdown_at) return make_fifo(raw_fifo, &raw_fd);
+
+  fd_close(raw_fd);
+  raw_fd = -1;
+
+  return 0;
+}
+
+/* raw lines only go to a server that has welcomed us, and count against -l
+ * like any others; until then they wait in their FIFO */
+static int raw_ready(void) {
+  return raw_fd != -1 && irc_fd != -1 && irc_state >= IRC_IDENTIFIED
+         && flood_wait(now_ms()) <= 0;
+}
+
+/* a raw line has to be whole: at most MSGLEN bytes, ending in CRLF, with
+ * no other CR, LF or NUL in it */
+static int raw_valid(const char *line, size_t len) {
+  return len > 2 && len <= MSGLEN && line[len - 2] == '\r'
+         && line[len - 1] == '\n' && !memchr(line, '\r', len - 2)
+         && !memchr(line, '\0', len - 2);
+}
+
+static void raw_drop(void) {
+  raw_dropped++;
+  fprintf(stderr, "fifoirc: %s: dropped a line that isn't a whole IRC "
+          "line\n", raw_fifo);
+}
+
+/* send len bytes of whole lines, which are at the front of the FIFO if
+ * from_fifo, or else in buf; either way buf has a copy of them */
+static void raw_send(char *buf, size_t len, int from_fifo) {
+  unsigned long lines = count_lines(buf, len);
+  size_t left = len;
+  ssize_t n;
+  char *p, *end;
+
+  /* nothing we queued ourselves may still be on its way */
+  uring_flush();
+
+  if(from_fifo && !tls) {
+    while(left) {
+      n = splice(raw_fd, NULL, irc_fd, NULL, left, SPLICE_F_MOVE);
+      if(n == -1 && errno == EINTR) continue;
+      if(n <= 0) break;
+      left -= n;
+    }
+  } else {
+    if(from_fifo && read(raw_fd, buf, len) != (ssize_t)len) return;
+    irc_send(buf, len);
+  }
+
+  raw_lines += lines;
+  if(flood_interval) flood_tat += flood_interval * lines;
+
+  for(p = buf; verbose > IRC_MSG && lines--; p = end + 2) {
+    end = memchr(p, '\r', buf + len - p);
+    *end = '\0';
+    safe_print('>', p);
+  }
+}
+
+/* -a: lines that are already IRC commands are looked at through a copy
+ * made with tee(), and the whole ones at the front of the FIFO are spliced
+ * straight to the server; returns -1 once the writer has gone */
+static int raw_read(void) {
+  char buf[RAW_PEEK];
+  long long wait;
+  size_t good, len, lines, most;
+  ssize_t n;
+  char *nl;
+
+  if(raw_pipe[0] == -1 && pipe2(raw_pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+    perror("fifoirc: pipe");
+    return 0;
+  }
+
+  while(raw_ready()) {
+    n = tee(raw_fd, raw_pipe[1], sizeof(buf), SPLICE_F_NONBLOCK);
+    if(n == 0) {
+      if(raw_in.len) raw_drop();
+      raw_in.len = 0;
+      raw_skip = 0;
+      return -1;
+    }
+    if(n == -1 || (n = read(raw_pipe[0], buf, n)) <= 0) return 0;
+
+    /* the rest of a line that came in pieces is copied */
+    if(raw_in.len || raw_skip) {
+      nl = memchr(buf, '\n', n);
+      len = nl ? (size_t)(nl - buf) + 1 : (size_t)n;
+      if(read(raw_fd, buf, len) != (ssize_t)len) return 0;
+
+      if(raw_skip) {
+        raw_skip = !nl;
+      } else if(raw_in.len + len > MSGLEN) {
+        raw_drop();
+        raw_in.len = 0;
+        raw_skip = !nl;
+      } else {
+        memcpy(raw_in.buf + raw_in.len, buf, len);
+        raw_in.len += len;
+        if(nl) {
+          if(raw_valid(raw_in.buf, raw_in.len))
+            raw_send(raw_in.buf, raw_in.len, 0);
+          else
+            raw_drop();
+          raw_in.len = 0;
+        }
+      }
+      continue;
+    }
+
+    /* as many whole lines as -l allows go straight through */
+    wait = flood_wait(now_ms());
+    most = flood_interval ? 1 - wait / flood_interval : (size_t)n;
+    for(good = lines = 0; good < (size_t)n && lines < most; lines++) {
+      if(!(nl = memchr(buf + good, '\n', n - good))) break;
+      len = nl - (buf + good) + 1;
+      if(!raw_valid(buf + good, len)) break;
+      good += len;
+    }
+    if(good) {
+      raw_send(buf, good, 1);
+      continue;
+    }
+
+    /* the first line is bad, or not all there yet; a partial one is kept
+     * aside, or poll() would keep telling us about it */
+    nl = memchr(buf, '\n', n);
+    len = nl ? (size_t)(nl - buf) + 1 : (size_t)n;
+    if(read(raw_fd, buf, len) != (ssize_t)len) return 0;
+    if(nl || len >= MSGLEN) {
+      raw_drop();
+      raw_skip = !nl;
+    } else {
+      memcpy(raw_in.buf, buf, len);
+      raw_in.len = len;
+    }
+  }
+
+  return 0;
+}
+
+/* map the ring; its bell is next to it, at <path>.bell */
+static int ring_map(void) {
+  size_t len = strlen(ring_path) + 6;
+  void *mem;
+
+  if(!(ring_bell = malloc(len))) {
+    perror("fifoirc: malloc");
+    return -1;
+  }
+  snprintf(ring_bell, len, "%s.bell", ring_path);
+
+  mem = mmap(NULL, sizeof(*ring) + RING_SIZE, PROT_READ | PROT_WRITE,
+             MAP_SHARED, ring_fd, 0);
+  if(mem == MAP_FAILED) {
+    perror("fifoirc: mmap");
+    return -1;
+  }
+  ring = mem;
+
+  return 0;
+}
+
+/* make the -R ring and the FIFO writers ring to wake us up; a ring left by
+ * an earlier run may have writers stuck on it, so it's always made afresh */
+static int make_ring(void) {
+  umask(0);
+  unlink(ring_path);
+  ring_fd = open(ring_path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+                 fifo_perms);
+  if(ring_fd == -1 || ftruncate(ring_fd, sizeof(*ring) + RING_SIZE) == -1) {
+    fprintf(stderr, "fifoirc: %s: %s\n", ring_path, strerror(errno));
+    return -1;
+  }
+
+  if(ring_map() == -1) return -1;
+
+  ring->size = RING_SIZE;
+  ring->version = FIFOIRC_RING_VERSION;
+  __atomic_store_n(&ring->magic, FIFOIRC_RING_MAGIC, __ATOMIC_RELEASE);
+
+  /* opened for writing too so that it never reports a hangup */
+  if((mkfifo(ring_bell, fifo_perms) == -1 && errno != EEXIST)
+     || (bell_fd = open(ring_bell, O_RDWR | O_NONBLOCK | O_CLOEXEC)) == -1) {
+    fprintf(stderr, "fifoirc: %s: %s\n", ring_bell, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+static uint32_t *ring_word(uint64_t pos) {
+  return (uint32_t *)((unsigned char *)(ring + 1) + (pos & (RING_SIZE - 1)));
+}
+
+/* about to sleep in poll(): ask writers to wake us, unless there's already
+ * something to read */
+static int ring_sleep(void) {
+  __atomic_store_n(&ring->sleeping, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  return __atomic_load_n(ring_word(ring->head), __ATOMIC_ACQUIRE) != 0;
+}
+
+/* anyone allowed to write to the ring can scribble on it, so a record that
+ * no writer could have made throws away everything that's in there */
+static void ring_reset(void) {
+  uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+  fprintf(stderr, "fifoirc: %s: bad record, emptying the ring\n", ring_path);
+  memset(ring + 1, 0, RING_SIZE);
+  __atomic_store_n(&ring->head, tail, __ATOMIC_RELEASE);
+}
+
+/* take lines from the ring, clearing the space behind us for writers to
+ * find zeroed */
+static void ring_read(void) {
+  unsigned char *data = (unsigned char *)(ring + 1);
+  char line[BUFLEN];
+  uint64_t head = ring->head, tail, pos, off, need;
+  uint32_t word, len, n;
+  char c;
+  int lines;
+
+  __atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+
+  for(lines = 0; lines < RING_BATCH; lines++) {
+    word = __atomic_load_n(ring_word(head), __ATOMIC_ACQUIRE);
+    if(!(word & FIFOIRC_RING_READY)) break;
+    len = word & ~FIFOIRC_RING_READY;
+    need = (sizeof(word) + len + FIFOIRC_RING_ALIGN - 1)
+           & ~(uint64_t)(FIFOIRC_RING_ALIGN - 1);
+
+    /* it has to fit, and have been claimed by a writer */
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if(need > RING_SIZE || tail - head > RING_SIZE || tail - head < need) {
+      ring_reset();
+      break;
+    }
+
+    /* a record should be one line, but one holding several is split up at
+     * CR and LF, or they'd reach the server as commands of their own; a
+     * line too long for the buffer goes out in pieces, as from the FIFO */
+    for(pos = head + sizeof(word), n = 0; len--; pos++) {
+      c = data[pos & (RING_SIZE - 1)];
+      if(c != '\r' && c != '\n') line[n++] = c;
+      if(n && (c == '\r' || c == '\n' || !len || n == sizeof(line) - 1)) {
+        line[n] = '\0';
+        fifo_line(line);
+        n = 0;
+      }
+    }
+
+    off = head & (RING_SIZE - 1);
+    if(off + need <= RING_SIZE) {
+      memset(data + off, 0, need);
+    } else {
+      memset(data + off, 0, RING_SIZE - off);
+      memset(data, 0, off + need - RING_SIZE);
+    }
+
+    head += need;
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+  }
+
+  if(lines) queue_flush();
+}
+
+/* listen on the -U socket; each packet a writer sends is one message, so
+ * writers can't get in each other's way the way they can in the FIFO */
+static int make_socket(void) {
+  struct sockaddr_un addr;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(strlen(sock_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "fifoirc: %s: path too long\n", sock_path);
+    return -1;
+  }
+  strcpy(addr.sun_path, sock_path);
+
+  unlink(sock_path);
+  listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                     0);
+  if(listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&addr,
+                             sizeof(addr)) == -1
+     || chmod(sock_path, fifo_perms) == -1 || listen(listen_fd, 16) == -1) {
+    fprintf(stderr, "fifoirc: %s: %s\n", sock_path, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+static void writer_accept(void) {
+  struct writer *w;
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  int fd;
+
+  while((fd = accept4(listen_fd, NULL, NULL,
+                      SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+    if(nwriters == MAXWRITERS) {
+      fprintf(stderr, "fifoirc: %s: more than %d writers\n", sock_path,
+              MAXWRITERS);
+      close(fd);
+      continue;
+    }
+
+    w = &writers[nwriters++];
+    memset(w, 0, sizeof(*w));
+    w->fd = fd;
+    if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0) {
+      w->pid = cred.pid;
+      w->uid = cred.uid;
+    }
+
+    if(verbose > INFO)
+      printf(" -- writer pid %d (uid %d) connected\n", (int)w->pid,
+             (int)w->uid);
+  }
+}
+
+/* take a message from a writer, or notice that it has gone; says how many
+ * messages there were, or -1 if it's gone */
+static int writer_read(struct writer *w) {
+  char buf[8 * BUFLEN];
+  struct iovec iov = { buf, sizeof(buf) - 1 };
+  struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1 };
+  ssize_t n;
+  char *p;
+
+  n = recvmsg(w->fd, &mh, 0);
+  if(n == -1 && (errno == EAGAIN || errno == EINTR)) return 0;
+  if(n <= 0) {
+    if(verbose > INFO)
+      printf(" -- writer pid %d (uid %d) went away after %lu lines\n",
+             (int)w->pid, (int)w->uid, w->lines);
+    fd_close(w->fd);
+    w->fd = -1;
+    return -1;
+  }
+
+  /* the rest of a message that doesn't fit is gone */
+  if(mh.msg_flags & MSG_TRUNC)
+    fprintf(stderr, "fifoirc: writer pid %d sent more than %d bytes at "
+            "once; the rest was lost\n", (int)w->pid, (int)sizeof(buf) - 1);
+
+  buf[n] = '\0';
+  if((p = text_command(buf, LANE_BULK))) w->lines += route_text(p, LANE_BULK);
+  else w->lines++;
+  queue_flush();
+
+  return 1;
+}
+
+/* whatever hasn't been sent by now is lost */
+static void quit(void) {
+  if(shutdown_at && verbose > INFO)
+    printf(" -- %lu lines sent while shutting down, %lu not sent\n",
+           lines_sent - shutdown_sent, queue_len);
+  if(queue_len)
+    fprintf(stderr, "fifoirc: quitting with %lu lines not sent\n",
+            queue_len);
+  if(raw_waiting())
+    fprintf(stderr, "fifoirc: quitting with raw lines not sent\n");
+
+  if(irc_fd != -1 && irc_state != IRC_CONNECTING)
+    irc_write("QUIT :" QUIT_REASON);
+  uring_flush();
+  lines_lost += queue_len;
+  print_stats();
+
+  exit(EXIT_SUCCESS);
+}
+
+static void unlink_fifo(void) {
+  static int done;
+
+  if(done++) return;
+
+  unlink(fifo);
+  if(urgent_fifo) unlink(urgent_fifo);
+  if(raw_fifo) unlink(raw_fifo);
+  if(ring) {
+    unlink(ring_path);
+    unlink(ring_bell);
+  }
+  if(listen_fd != -1) unlink(sock_path);
+}
+
+/* SIGINT or SIGTERM (or SIGHUP without -i): take whatever has already been
+ * written to us, stop taking any more, and quit once it has all been sent,
+ * or at shutdown_at; a second signal quits straight away */
+static void shutdown_start(void) {
+  struct child *ch;
+  uint64_t head;
+  int i, n;
+
+  if(shutdown_at) quit();
+
+  shutdown_at = now_ms() + SHUTDOWN_TIMEOUT;
+  shutdown_sent = lines_sent;
+  if(verbose > INFO)
+    printf(" -- shutting down, %lu lines to send\n", queue_len);
+
+  while(fifo_fd != -1 && text_handle(fifo_fd, &fifo_in, fifo_line) > 0);
+  while(urgent_fd != -1
+        && text_handle(urgent_fd, &urgent_in, urgent_line) > 0);
+  do {
+    head = ring ? ring->head : 0;
+    if(ring) ring_read();
+  } while(ring && ring->head != head);
+  for(i = 0; i < nwriters; i++)
+    while(writers[i].fd != -1 && writer_read(&writers[i]) > 0);
+  for(i = 0; program && i < nchildren; i++) {
+    ch = &children[i];
+    while(ch->fd != -1
+          && (n = text_handle(ch->fd, &ch->in, program_line)) > 0)
+      ch->replies += n;
+  }
+
+  /* writers find the pipes and socket gone rather than nobody reading; raw
+   * lines are left where they are until they can be passed on */
+  unlink_fifo();
+  if(fifo_fd != -1) fd_close(fifo_fd);
+  if(urgent_fd != -1) fd_close(urgent_fd);
+  if(bell_fd != -1) fd_close(bell_fd);
+  if(listen_fd != -1) fd_close(listen_fd);
+  fifo_fd = urgent_fd = bell_fd = listen_fd = -1;
+  for(i = 0; i < nwriters; i++) {
+    if(writers[i].fd != -1) fd_close(writers[i].fd);
+    writers[i].fd = -1;
+  }
+  nwriters = 0;
+
+  /* the -e program is sent nothing more, so it may as well go */
+  for(i = 0; program && i < nchildren; i++)
+    if(children[i].pid && children[i].fd != -1) child_hangup(&children[i]);
+  if(standby.pid && standby.fd != -1) child_hangup(&standby);
+
+  queue_flush();
+}
 
-#define INFO     0
-#define IRC_MSG  1
+/* deal with whatever is due, and work out how long poll() can sleep */
+static int timers(void) {
+  char msg[BUFLEN];
+  long long now = now_ms();
+  long long next = now + PING_INTERVAL;
+  long long t;
 
-#define BUFLEN 1024
+  if(reconnect_at) {
+    if(now >= reconnect_at) {
+      reconnect_at = 0;
+      irc_connect();
+      return 0;
+    }
+    if(reconnect_at < next) next = reconnect_at;
+  }
 
-static char *server = "irc.freenode.net";
-static char *channel = "#maximilian";
-static char *nickname;
-static uint16_t port = 6667;
-static char *fifo, *fullname, *nspasswd, *program;
-static int verbose, reconnect;
-static int fifo_perms = 0666;
+  if(irc_fd != -1 && irc_state == IRC_CONNECTING) {
+    if(now >= connect_deadline) {
+      fprintf(stderr, "fifoirc: connect %s: timed out\n", server);
+      irc_disconnect();
+      return 0;
+    }
+    if(connect_deadline < next) next = connect_deadline;
+  }
 
-static time_t recv_time;
+  if(shutdown_at) {
+    if((!queue_len && !raw_waiting()) || now >= shutdown_at) quit();
+    if(shutdown_at < next) next = shutdown_at;
+  }
 
-static int fifo_fd = -1, irc_fd = -1, program_fd = -1;
+  if(program && !shutdown_at) respawn_children(now, &next);
 
-static pid_t childpid;
+  if(dedup_window) dedup_expire(now, &next);
+  target_expire(now, &next);
 
-static void usage(void) {
-  puts("fifoirc by James Stanley\n"
-       "Usage: fifoirc [-c <channel>] [-e <program>] [-f <path to fifo>]\n"
-       "               [-F <full name>] [-m <mode>] [-n <nickname>]\n"
-       "               [-p <port>] [-P <nickserv password>] [-r]\n"
-       "               [-s <server>] [-vv]\n"
-       "\n"
-       "Options:\n"
-       " -c  channel to join\n"
-       " -e  program to pipe IRC text to (note: uses 'sh -c')\n"
-       " -f  path to the FIFO to use\n"
-       " -F  IRC full name\n"
-       " -m  FIFO permission modes in octal (default: 0666)\n"
-       " -n  IRC nickname\n"
-       " -p  port on the IRC server\n"
-       " -P  password to authenticate with NickServ\n"
-       " -r  reconnect to the server if the connection is lost\n"
-       " -s  server to connect to\n"
-       " -v  be verbose, specify twice to increase verbosity\n"
-       );
-  exit(0);
+  /* lines held back by flood control, and the PING to confirm them */
+  if(irc_state == IRC_JOINED
+     && ((queue_len && flood_interval) || (sent_tail && !fence_seq))) {
+    if(flood_wait(now) <= 0) queue_flush();
+    if((t = flood_wait(now)) > 0 && now + t < next) next = now + t;
+    if(sent_tail && !fence_seq && fence_ms + FENCE_INTERVAL > now
+       && fence_ms + FENCE_INTERVAL < next)
+      next = fence_ms + FENCE_INTERVAL;
+  }
+
+  /* raw lines wait in their FIFO while flood control holds them back */
+  if(raw_fd != -1 && irc_state >= IRC_IDENTIFIED && flood_interval
+     && (t = flood_wait(now)) > 0 && now + t < next)
+    next = now + t;
+
+  if(identify_deadline) {
+    if(now >= identify_deadline) {
+      fprintf(stderr, "fifoirc: no reply from NickServ, joining anyway\n");
+      irc_identified();
+    } else if(identify_deadline < next) {
+      next = identify_deadline;
+    }
+  }
+
+  if(irc_fd != -1 && irc_state != IRC_CONNECTING) {
+    if(now >= recv_ms + PING_TIMEOUT) {
+      fprintf(stderr, "fifoirc: ping timeout: %d seconds\n",
+              (int)((now - recv_ms) / 1000));
+      irc_disconnect();
+      return 0;
+    }
+
+    if(!ping_sent && now >= recv_ms + PING_INTERVAL) {
+      snprintf(msg, BUFLEN, "PING :%s", server);
+      irc_write(msg);
+      ping_sent = 1;
+    }
+
+    t = recv_ms + (ping_sent ? PING_TIMEOUT : PING_INTERVAL);
+    if(t < next) next = t;
+  }
+
+  return next - now;
 }
 
-static int make_fifo(void) {
-  struct stat buf;
 
-  if(fifo_fd != -1) close(fifo_fd);
+/* getopt()'s idea of our options */
+#define OPTIONS "a:b:c:C:d:D:e:E:f:F:i:j:Jkl:m:n:o:p:P:q:rR:s:StTu:U:vwW:x"
 
-  if(stat(fifo, &buf) != -1) {
-    if(!S_ISFIFO(buf.st_mode)) {
-      fprintf(stderr, "fifoirc: %s: exists and is not a fifo\n", fifo);
+/* the names options go by in the -i file */
+static const struct {
+  const char *name;
+  int opt;
+} config_names[] = {
+  { "raw", 'a' },         { "buffer", 'b' },   { "channel", 'c' },
+  { "certificate", 'C' }, { "dispatch", 'd' }, { "dedup", 'D' },
+  { "program", 'e' },     { "events", 'E' },   { "fifo", 'f' },
+  { "fullname", 'F' },    { "children", 'j' }, { "json", 'J' },
+  { "insecure", 'k' },    { "flood", 'l' },    { "mode", 'm' },
+  { "nick", 'n' },        { "overflow", 'o' }, { "port", 'p' },
+  { "password", 'P' },    { "spool", 'q' },    { "reconnect", 'r' },
+  { "ring", 'R' },        { "server", 's' },   { "commands", 'S' },
+  { "tls", 't' },         { "route", 'T' },    { "urgent", 'u' },
+  { "socket", 'U' },      { "verbose", 'v' },  { "standby", 'w' },
+  { "weight", 'W' },      { "exec", 'x' },
+};
+
+#define NCONFIG (sizeof(config_names) / sizeof(config_names[0]))
+
+static int read_config(const char *path);
+
+static char *config_value(const char *value) {
+  char **values;
+  size_t i;
+
+  for(i = 0; i < nconfig_values; i++)
+    if(strcmp(config_values[i], value) == 0) return config_values[i];
+
+  if(!(values = realloc(config_values,
+                        (nconfig_values + 1) * sizeof(*values)))) {
+    perror("fifoirc: malloc");
+    return NULL;
+  }
+  config_values = values;
+  if(!(values[nconfig_values] = strdup(value))) {
+    perror("fifoirc: malloc");
+    return NULL;
+  }
+
+  return values[nconfig_values++];
+}
+
+/* apply an option from the command line or the -i file; flags in the file
+ * may be turned off with "no", and verbose takes a level */
+static int set_option(int c, char *arg) {
+  int on = !arg || (strcmp(arg, "no") != 0 && strcmp(arg, "off") != 0
+                    && strcmp(arg, "0") != 0);
+  char *p;
+
+  switch(c) {
+  case 'a': raw_fifo = arg;                         break;
+  case 'b': child_hiwat = strtoul(arg, NULL, 10);   break;
+  case 'c': channel = arg;                          break;
+  case 'C': tls_cert = arg;                         break;
+  case 'd':
+    if(strcmp(arg, "least") == 0) dispatch_least = 1;
+    else if(strcmp(arg, "rr") == 0) dispatch_least = 0;
+    else return -1;
+    break;
+  case 'D': dedup_window = atoi(arg) * 1000LL;      break;
+  case 'e': program = arg;                          break;
+  case 'E':
+    if(strcmp(arg, "uring") == 0) use_uring = 1;
+    else if(strcmp(arg, "poll") == 0) use_uring = 0;
+    else return -1;
+    break;
+  case 'f': fifo = arg;                             break;
+  case 'F': fullname = arg;                         break;
+  case 'i':
+    config_path = arg;
+    return read_config(arg);
+  case 'j': nchildren = atoi(arg);                  break;
+  case 'J': json_mode = on;                         break;
+  case 'k': tls_noverify = on;                      break;
+  case 'l':
+    flood_interval = strtol(arg, &p, 10);
+    flood_burst = *p == ':' ? atoi(p + 1) : FLOOD_BURST;
+    if(flood_interval < 0 || flood_burst < 1) return -1;
+    break;
+  case 'm': fifo_perms = strtoul(arg, NULL, 8);     break;
+  case 'n': nickname = arg;                         break;
+  case 'o':
+    if(strcmp(arg, "oldest") == 0) overflow = OVERFLOW_DROP_OLDEST;
+    else if(strcmp(arg, "newest") == 0) overflow = OVERFLOW_DROP_NEWEST;
+    else if(strcmp(arg, "pause") == 0) overflow = OVERFLOW_PAUSE;
+    else return -1;
+    break;
+  case 'p': port = atoi(arg);                       break;
+  case 'P': nspasswd = arg;                         break;
+  case 'q': spool_max = strtoul(arg, NULL, 10);     break;
+  case 'r': reconnect = on;                         break;
+  case 'R': ring_path = arg;                        break;
+  case 's':
+    if(nservers == MAXSERVERS) {
+      fprintf(stderr, "fifoirc: at most %d servers\n", MAXSERVERS);
       return -1;
     }
-  } else {
-    umask(0);
-    if(mkfifo(fifo, fifo_perms) == -1) {
-      fprintf(stderr, "fifoirc: mkfifo %s: %s\n", fifo, strerror(errno));
+    servers[nservers++] = arg;
+    break;
+  case 'S': use_commands = on;                      break;
+  case 't': use_tls = on;                           break;
+  case 'T': route_fifo = on;                        break;
+  case 'u': urgent_fifo = arg;                      break;
+  case 'U': sock_path = arg;                        break;
+  case 'v':
+    if(!arg) verbose++;
+    else verbose = on ? (atoi(arg) > 1 ? atoi(arg) : 1) : 0;
+    break;
+  case 'w': use_standby = on;                       break;
+  case 'W':
+    if(nweights == MAXWEIGHTS) {
+      fprintf(stderr, "fifoirc: at most %d weights\n", MAXWEIGHTS);
       return -1;
     }
+    if(!(p = strrchr(arg, '=')) || atoi(p + 1) < 1) return -1;
+    weights[nweights].name = arg;
+    weights[nweights].namelen = p - arg;
+    weights[nweights++].weight = atoi(p + 1);
+    break;
+  case 'x': direct_exec = on;                       break;
+  default:  return -1;
   }
 
-  fifo_fd = open(fifo, O_RDONLY | O_NONBLOCK, 0);
-  if(fifo_fd == -1) {
-    fprintf(stderr, "fifoirc: open %s: %s\n", fifo, strerror(errno));
+  return 0;
+}
+
+/* settings from a file, one per line: an option's name from config_names
+ * and its value, if it takes one; lines starting with # are comments */
+static int read_config(const char *path) {
+  char line[BUFLEN];
+  char *name, *value, *end;
+  int servers_seen = 0, weights_seen = 0;
+  int lineno = 0, err = 0;
+  size_t i;
+  FILE *f;
+
+  if(!(f = fopen(path, "r"))) {
+    fprintf(stderr, "fifoirc: %s: %s\n", path, strerror(errno));
     return -1;
   }
 
-  return 0;
+  while(fgets(line, sizeof(line), f)) {
+    lineno++;
+
+    name = line + strspn(line, " \t");
+    end = name + strlen(name);
+    while(end > name && isspace((unsigned char)end[-1])) end--;
+    *end = '\0';
+    if(!*name || *name == '#') continue;
+
+    value = name + strcspn(name, " \t");
+    if(*value) {
+      *value++ = '\0';
+      value += strspn(value, " \t");
+    }
+
+    for(i = 0; i < NCONFIG && strcmp(config_names[i].name, name) != 0; i++);
+    if(i == NCONFIG) {
+      fprintf(stderr, "fifoirc: %s:%d: unknown setting %s\n", path, lineno,
+              name);
+      err = -1;
+      continue;
+    }
+
+    /* servers and weights in the file replace any there were */
+    if(config_names[i].opt == 's' && !servers_seen++) nservers = 0;
+    if(config_names[i].opt == 'W' && !weights_seen++) nweights = 0;
+
+    /* what's set here has to outlive the line; a flag on its own is on */
+    if(*value) value = config_value(value);
+    else if(strchr(OPTIONS, config_names[i].opt)[1] != ':') value = "yes";
+    else value = NULL;
+
+    if(!value || set_option(config_names[i].opt, value) == -1) {
+      fprintf(stderr, "fifoirc: %s:%d: bad %s\n", path, lineno, name);
+      err = -1;
+    }
+  }
+
+  fclose(f);
+
+  return err;
 }
 
-static int start_program(void) {
-  int fd[2];
+/* -x runs the program itself rather than through the shell, so split it
+ * into words; there's no quoting */
+static int split_program(void) {
+  char *p = strdup(program);
+  int i;
 
-  if(program_fd != -1) close(program_fd);
+  for(i = 0; i < MAXARGS - 1 && (program_argv[i] = strtok(i ? NULL : p,
+                                                          " \t")); i++);
+  program_argv[i] = NULL;
 
-  if(socketpair(AF_UNIX, SOCK_STREAM, 0, fd) == -1) {
-    perror("fifoirc: socketpair");
-    return -1;
+  return program_argv[0] ? 0 : -1;
+}
+
+/* SIGHUP with -i: read the file again and apply whatever changed, without
+ * dropping the connection; servers, ports and TLS and login settings are
+ * only used when connecting, so they take effect the next time we do */
+static void reload_config(void) {
+  char msg[BUFLEN];
+  char *old_channel = channel, *old_nick = nickname, *old_fifo = fifo;
+  char *old_urgent = urgent_fifo, *old_raw = raw_fifo;
+  char *old_program = program;
+  int old_children = nchildren, old_exec = direct_exec;
+  int old_standby = use_standby;
+  unsigned long old_hiwat = child_hiwat;
+  struct target *t;
+  struct child *ch;
+  char *out;
+  int i, err;
+
+  verbose = file_verbose;
+  nservers = file_nservers;
+  nweights = file_nweights;
+  err = read_config(config_path);
+  file_verbose = verbose;
+  file_nservers = nservers;
+  file_nweights = nweights;
+  for(i = 0; i < ncli_options; i++)
+    set_option(cli_options[i].opt, cli_options[i].arg);
+
+  if(err == -1)
+    fprintf(stderr, "fifoirc: %s: some settings not applied\n", config_path);
+  else if(verbose > INFO)
+    printf(" -- reloaded %s\n", config_path);
+
+  if(!nservers) nservers = 1;
+  if(cur_server >= nservers) cur_server = 0;
+  if(nchildren < 1 || nchildren > MAXCHILDREN) {
+    fprintf(stderr, "fifoirc: -j: between 1 and %d children\n", MAXCHILDREN);
+    nchildren = old_children;
+  }
+  if(strlen(channel) > 200) {
+    fprintf(stderr, "fifoirc: %s: channels must be at most 200 characters\n",
+            channel);
+    channel = old_channel;
   }
 
-  program_fd = fd[1];
+  if(strcasecmp(channel, old_channel) != 0 && irc_state != IRC_CONNECTING) {
+    if(irc_state == IRC_JOINED) {
+      snprintf(msg, BUFLEN, "PART %s", old_channel);
+      irc_write(msg);
+      if((t = target_find(old_channel))) t->joined = 0;
+      if((t = target_get(channel))) target_join(t);
+    } else if(irc_state == IRC_IDENTIFIED) {
+      snprintf(msg, BUFLEN, "JOIN %s", channel);
+      irc_write(msg);
+    }
+  }
 
-  if((childpid = fork()) == -1) {
-    perror("fifoirc: fork");
-    return -1;
+  if(strcmp(nickname, old_nick) != 0 && irc_state != IRC_CONNECTING) {
+    snprintf(msg, BUFLEN, "NICK %s", nickname);
+    irc_write(msg);
   }
 
-  if(childpid == 0) {
-    dup2(fd[0], STDIN_FILENO);
-    dup2(fd[0], STDOUT_FILENO);
+  if(strcmp(fifo, old_fifo) != 0) {
+    unlink(old_fifo);
+    fifo_in.len = 0;
+    if(make_fifo(fifo, &fifo_fd) == 0 && verbose > INFO)
+      printf(" -- fifo at %s\n", fifo);
+  }
+  if(urgent_fifo && (!old_urgent || strcmp(urgent_fifo, old_urgent) != 0)) {
+    if(old_urgent) unlink(old_urgent);
+    urgent_in.len = 0;
+    if(make_fifo(urgent_fifo, &urgent_fd) == 0 && verbose > INFO)
+      printf(" -- urgent fifo at %s\n", urgent_fifo);
+  }
+  if(raw_fifo && (!old_raw || strcmp(raw_fifo, old_raw) != 0)) {
+    if(old_raw) unlink(old_raw);
+    raw_in.len = 0;
+    raw_skip = 0;
+    if(make_fifo(raw_fifo, &raw_fd) == 0 && verbose > INFO)
+      printf(" -- raw fifo at %s\n", raw_fifo);
+  }
 
-    execl("/bin/sh", "sh", "-c", program, (void *)0);
+  for(t = targets; t; t = t->next)
+    target_weigh(t);
 
-    fprintf(stderr, "fifoirc: execl /bin/sh -c %s: %s\n", program,
-            strerror(errno));
-    kill(getppid(), SIGTERM);
-    exit(1);
+  /* the buffers can grow, but a child may already have more than a smaller
+   * limit in its buffer, so they never shrink */
+  for(i = 0; child_hiwat > old_hiwat && i < MAXCHILDREN; i++) {
+    ch = &children[i];
+    if(ch->out && (out = realloc(ch->out, child_hiwat + BUFLEN))) ch->out = out;
   }
+  if(child_hiwat > old_hiwat && standby.out
+     && (out = realloc(standby.out, child_hiwat + BUFLEN)))
+    standby.out = out;
 
-  return 0;
-}
+  if(program) {
+    /* a different program: all the children are replaced as they exit */
+    if(!old_program || strcmp(program, old_program) != 0
+       || direct_exec != old_exec) {
+      if(direct_exec && split_program() == -1) {
+        fprintf(stderr, "fifoirc: -e: no program\n");
+        program = old_program;
+        direct_exec = old_exec;
+      } else {
+        if(standby.pid) child_hangup(&standby);
+        for(i = 0; i < old_children; i++) {
+          if(children[i].pid) child_hangup(&children[i]);
+          else if(i < nchildren) start_program(&children[i]);
+        }
+      }
+    }
 
-static int make_tcp(const char *host, uint16_t port) {
-  struct sockaddr_in addr;
-  struct hostent *he;
-  int fd;
+    for(i = old_children; i < nchildren; i++)
+      if(!children[i].pid) start_program(&children[i]);
 
-  he = gethostbyname(host);
-  if(!he) {
-    fprintf(stderr, "fifoirc: gethostbyname %s: failed\n", host);
-    return -1;
+    /* reaped, but not respawned */
+    for(i = nchildren; i < old_children; i++) {
+      if(children[i].pid) kill(children[i].pid, SIGTERM);
+      child_reset(&children[i]);
+      children[i].pid = 0;
+      children[i].respawn_at = 0;
+    }
+
+    if(use_standby && !old_standby) start_program(&standby);
   }
-  if(he->h_addrtype != AF_INET) {
-    fprintf(stderr, "fifoirc: gethostbyname %s: not an IPv4 address\n", host);
-    return -1;
+
+  if(!use_standby && old_standby && standby.pid) {
+    kill(standby.pid, SIGTERM);
+    child_reset(&standby);
+    standby.pid = 0;
   }
 
-  memset(&addr, 0, sizeof(addr));
-  addr.sin_family = AF_INET;
-  addr.sin_port = htons(port);
-  memcpy(&(addr.sin_addr), he->h_addr, he->h_length);
+  queue_flush();
+}
 
-  fd = socket(AF_INET, SOCK_STREAM, 0);
-  if(fd == -1) {
-    perror("fifoirc: socket");
-    return -1;
+/* on SIGUSR2 we exec ourselves again, to pick up a new binary, and the
+ * descriptors cross the exec in one SCM_RIGHTS message; everything else is
+ * written to a memfd that goes with them, and read back in the same order
+ * by the same up_*() calls, so that saving and restoring can't disagree */
+struct upgrade {
+  FILE *f;
+  int saving;
+  int fds[MAXPASS];
+  int nfds;
+  int err;
+};
+
+static void up_io(struct upgrade *u, void *p, size_t n) {
+  if(u->err) return;
+
+  if((u->saving ? fwrite(p, 1, n, u->f) : fread(p, 1, n, u->f)) != n)
+    u->err = 1;
+}
+
+#define UP(u, x) up_io((u), &(x), sizeof(x))
+
+static void up_str(struct upgrade *u, char **s) {
+  size_t n = u->saving && *s ? strlen(*s) + 1 : 0;
+
+  UP(u, n);
+  if(!u->saving) {
+    *s = NULL;
+    if(u->err || !n) return;
+    if(n > BUFLEN * 16 || !(*s = malloc(n))) {
+      u->err = 1;
+      return;
+    }
   }
+  if(n) up_io(u, *s, n);
+  if(!u->saving && *s) (*s)[n - 1] = '\0';
+}
 
-  if(connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) == -1) {
-    perror("fifoirc: connect");
-    return -1;
+static void up_buf(struct upgrade *u, char *buf, size_t *len, size_t size) {
+  UP(u, *len);
+  if(*len > size) {
+    u->err = 1;
+    *len = 0;
   }
+  up_io(u, buf, *len);
+}
 
-  if(verbose > INFO) printf(" -- connected to %s:%hu\n", host, port);
+/* a descriptor is sent as its place in the SCM_RIGHTS array */
+static void up_fd(struct upgrade *u, int *fd) {
+  int i = -1;
 
-  return fd;
+  if(u->saving && *fd != -1) {
+    i = u->nfds;
+    u->fds[u->nfds++] = *fd;
+  }
+  UP(u, i);
+  if(!u->saving) *fd = i >= 0 && i < u->nfds ? u->fds[i] : -1;
 }
 
-static int get_line(int fd, char *buf, int len) {
-  ssize_t n;
+static void up_msg(struct upgrade *u, struct msg **mp) {
+  struct msg *m = *mp;
+  char *text = u->saving ? m->text : NULL;
 
-  while(--len && (n = read(fd, buf, 1)) == 1 && *buf++ != '\n');
-  *buf = '\0';
+  up_str(u, &text);
+  if(!u->saving) {
+    if(u->err || !text) return;
+    if(!(m = msg_alloc())) {
+      u->err = 1;
+      free(text);
+      return;
+    }
+    m->next = NULL;
+    m->to = NULL;
+    m->len = snprintf(m->text, MSGLEN, "%s", text);
+    if(m->len >= MSGLEN) m->len = MSGLEN - 1;
+    free(text);
+    *mp = m;
+  }
+  UP(u, m->lane);
+  UP(u, m->kind);
+  UP(u, m->queued);
+  UP(u, m->seq);
 
-  return n == 1 ? 0 : -1;
+  if(!u->saving && (m->lane < 0 || m->lane >= NLANES || m->kind < MSG_PRIVMSG
+                    || m->kind > MSG_COMMAND))
+    u->err = 1;
 }
 
-static void safe_print(char c, const char *text) {
-  const char *p;
+/* a target is sent by name, and made on the other side if it must be */
+static void up_target(struct upgrade *u, struct target **tp) {
+  char *name = u->saving && *tp ? (*tp)->name : NULL;
 
-  printf("%c ", c);
+  up_str(u, &name);
+  if(u->saving) return;
 
-  for(p = text; *p; p++) {
-    if(isprint(*p)) putchar(*p);
-    else printf("\\x%02x", *p);
+  *tp = name && !u->err ? target_get(name) : NULL;
+  if(name && !*tp) u->err = 1;
+  free(name);
+}
+
+static void up_targets(struct upgrade *u) {
+  struct target *t = targets;
+  struct msg *m, **end;
+  unsigned long n = ntargets, len;
+  int lane;
+
+  UP(u, n);
+  while(!u->err && n--) {
+    up_target(u, &t);
+    if(u->err) return;
+    UP(u, t->sent);
+    UP(u, t->deficit);
+    UP(u, t->turn);
+    UP(u, t->joined);
+    UP(u, t->joining);
+    UP(u, t->ours);
+
+    for(lane = 0; lane < NLANES; lane++) {
+      len = t->lane[lane].len;
+      UP(u, len);
+      m = t->lane[lane].head;
+      for(end = &t->lane[lane].head; !u->err && len--;) {
+        up_msg(u, &m);
+        if(u->err) return;
+        if(u->saving) {
+          m = m->next;
+          continue;
+        }
+        m->to = t;
+        m->lane = lane;
+        *end = m;
+        end = &m->next;
+        t->lane[lane].tail = m;
+        t->lane[lane].len++;
+        t->len++;
+        queue_len++;
+      }
+    }
+    if(u->saving) t = t->next;
   }
 
-  putchar('\n');
+  up_target(u, &cur_target);
+  up_target(u, &cur_urgent);
 }
 
-static ssize_t irc_write(int fd, const char *text) {
-  char msg[BUFLEN];
+/* lines the server has yet to confirm */
+static void up_sent(struct upgrade *u) {
+  unsigned long n = msg_count(sent_head);
+  struct msg *m = sent_head;
+  struct target *t;
 
-  snprintf(msg, BUFLEN, "%s\r\n", text);
+  UP(u, n);
+  while(!u->err && n--) {
+    t = m ? m->to : NULL;
+    up_target(u, &t);
+    up_msg(u, &m);
+    if(u->err) return;
 
-  if(verbose > IRC_MSG) safe_print('>', text);
+    if(u->saving) {
+      m = m->next;
+    } else {
+      m->to = t;
+      if(sent_tail) sent_tail->next = m;
+      else sent_head = m;
+      sent_tail = m;
+    }
+  }
+}
 
-  return write(fd, msg, strlen(msg));
+static void up_dedup(struct upgrade *u) {
+  unsigned long n = 0;
+  struct dedup *d;
+  int i;
+
+  for(i = 0; u->saving && i < DEDUP_SIZE; i++)
+    if(dedup[i].to) n++;
+
+  UP(u, n);
+  for(i = 0; !u->err && n; i++) {
+    if(u->saving && !dedup[i].to) continue;
+    n--;
+    UP(u, i);
+    if(i < 0 || i >= DEDUP_SIZE) {
+      u->err = 1;
+      return;
+    }
+    d = &dedup[i];
+    up_target(u, &d->to);
+    UP(u, d->hash);
+    UP(u, d->lane);
+    UP(u, d->kind);
+    UP(u, d->since);
+    UP(u, d->repeats);
+    up_str(u, &d->text);
+  }
 }
 
-static void irc_connect(void) {
-  char msg[BUFLEN];
+static void up_child(struct upgrade *u, struct child *ch) {
+  size_t size = child_hiwat + BUFLEN;
 
-  irc_fd = make_tcp(server, port);
-  if(irc_fd == -1) exit(EXIT_FAILURE);
+  UP(u, ch->pid);
+  up_fd(u, &ch->fd);
+  UP(u, ch->outlen);
+  if(!u->saving && (ch->pid || ch->outlen)) {
+    if(ch->outlen > size) size = ch->outlen;
+    if(!(ch->out = malloc(size))) u->err = 1;
+  }
+  if(ch->outlen) up_io(u, ch->out, ch->outlen);
+  UP(u, ch->partial);
+  up_buf(u, ch->in.buf, &ch->in.len, BUFLEN);
+  UP(u, ch->started);
+  UP(u, ch->respawn_at);
+  UP(u, ch->respawn_delay);
+  UP(u, ch->sent);
+  UP(u, ch->replies);
+  UP(u, ch->dropped);
+}
 
-  snprintf(msg, BUFLEN, "NICK %s", nickname);
-  irc_write(irc_fd, msg);
+/* everything there is to hand over, in one order for both directions */
+static void up_state(struct upgrade *u) {
+  uint32_t magic = UPGRADE_MAGIC, version = UPGRADE_VERSION;
+  unsigned long ncaps = NCAPS;
+  int i;
 
-  snprintf(msg, BUFLEN, "USER %s localhost %s :%s",
-           nickname, server, fullname);
-  irc_write(irc_fd, msg);
+  /* a binary that can't read this has to start afresh */
+  UP(u, magic);
+  UP(u, version);
+  if(!u->err && (magic != UPGRADE_MAGIC || version != UPGRADE_VERSION)) {
+    u->err = 2;
+    return;
+  }
+
+  up_fd(u, &irc_fd);
+  up_fd(u, &fifo_fd);
+  up_fd(u, &urgent_fd);
+  up_fd(u, &raw_fd);
+  up_fd(u, &ring_fd);
+  up_fd(u, &bell_fd);
+  up_fd(u, &listen_fd);
+  up_str(u, &fifo);
+  up_str(u, &urgent_fifo);
+  up_str(u, &raw_fifo);
+  up_str(u, &ring_path);
+  up_str(u, &sock_path);
 
-  if(nspasswd) {
-    snprintf(msg, BUFLEN, "PRIVMSG NickServ :identify %s %s",
-             nickname, nspasswd);
-    irc_write(irc_fd, msg);
+  UP(u, irc_state);
+  UP(u, irc_events);
+  UP(u, connect_ms);
+  UP(u, connect_deadline);
+  UP(u, identify_deadline);
+  UP(u, reconnect_at);
+  UP(u, backoff);
+  UP(u, delivered);
+  UP(u, sasl_done);
+  UP(u, cur_nick);
+  UP(u, cur_server);
+  UP(u, recv_ms);
+  UP(u, ping_sent);
+  UP(u, ncaps);
+  for(i = 0; !u->err && i < NCAPS && i < ncaps; i++) {
+    UP(u, caps[i].offered);
+    UP(u, caps[i].enabled);
   }
+  up_buf(u, irc_buf, &irc_buflen, BUFLEN);
+  up_buf(u, fifo_in.buf, &fifo_in.len, BUFLEN);
+  up_buf(u, urgent_in.buf, &urgent_in.len, BUFLEN);
+  up_buf(u, raw_in.buf, &raw_in.len, BUFLEN);
+  UP(u, raw_skip);
 
-  snprintf(msg, BUFLEN, "JOIN %s", channel);
-  irc_write(irc_fd, msg);
+  UP(u, next_seq);
+  UP(u, fence_seq);
+  UP(u, flood_tat);
+  UP(u, lines_sent);
+  UP(u, lines_confirmed);
+  UP(u, lines_retried);
+  UP(u, lines_lost);
+  UP(u, lines_repeated);
+  UP(u, raw_lines);
+  UP(u, raw_dropped);
+  UP(u, lane_lines);
+  UP(u, lane_wait);
+  UP(u, lane_worst);
+  up_targets(u);
+  up_sent(u);
+  UP(u, dedup_pending);
+  up_dedup(u);
+
+  UP(u, nchildren);
+  if(nchildren < 1 || nchildren > MAXCHILDREN) u->err = 1;
+  UP(u, next_child);
+  UP(u, child_dropped);
+  for(i = 0; !u->err && i < nchildren; i++)
+    up_child(u, &children[i]);
+  up_child(u, &standby);
 
-  recv_time = time(NULL);
+  UP(u, nwriters);
+  if(nwriters < 0 || nwriters > MAXWRITERS) u->err = 1;
+  for(i = 0; !u->err && i < nwriters; i++) {
+    up_fd(u, &writers[i].fd);
+    UP(u, writers[i].pid);
+    UP(u, writers[i].uid);
+    UP(u, writers[i].lines);
+  }
 }
 
-static void irc_disconnect(void) {
-  close(irc_fd);
+static int upgrade_send(int sock, int *fds, int n) {
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int) * MAXPASS)];
+  } ctl;
+  struct msghdr mh;
+  struct iovec iov;
+  struct cmsghdr *cm;
+  char byte = 0;
 
-  fprintf(stderr, "fifoirc: disconnection from %s\n", server);
+  memset(&mh, 0, sizeof(mh));
+  iov.iov_base = &byte;
+  iov.iov_len = 1;
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = ctl.buf;
+  mh.msg_controllen = CMSG_SPACE(sizeof(int) * n);
 
-  if(reconnect) irc_connect();
-  else exit(EXIT_FAILURE);
+  cm = CMSG_FIRSTHDR(&mh);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(sizeof(int) * n);
+  memcpy(CMSG_DATA(cm), fds, sizeof(int) * n);
+
+  return sendmsg(sock, &mh, 0) == -1 ? -1 : 0;
 }
 
-static void irc_handle(void) {
-  char line[BUFLEN];
-  char msg[BUFLEN];
-  char *nick;
-  char *endline;
-  char *p;
+static int upgrade_recv(int sock, int *fds) {
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int) * MAXPASS)];
+  } ctl;
+  struct msghdr mh;
+  struct iovec iov;
+  struct cmsghdr *cm;
+  char byte;
+  int n;
 
-  if(get_line(irc_fd, line, BUFLEN) == -1) irc_disconnect();
-  if((endline = strpbrk(line, "\r\n"))) *endline = '\0';
+  memset(&mh, 0, sizeof(mh));
+  iov.iov_base = &byte;
+  iov.iov_len = 1;
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = ctl.buf;
+  mh.msg_controllen = sizeof(ctl.buf);
 
-  if(verbose > IRC_MSG) safe_print('<', line);
+  if(recvmsg(sock, &mh, MSG_CMSG_CLOEXEC | MSG_DONTWAIT) == -1) return -1;
+
+  if(!(cm = CMSG_FIRSTHDR(&mh)) || cm->cmsg_level != SOL_SOCKET
+     || cm->cmsg_type != SCM_RIGHTS) {
+    errno = EPROTO;
+    return -1;
+  }
+
+  n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+  memcpy(fds, CMSG_DATA(cm), sizeof(int) * n);
+
+  return n;
+}
 
-  recv_time = time(NULL);
+/* SIGUSR2: replace ourselves with whatever binary is now where we were
+ * started from, without dropping the connection; if that fails, we carry
+ * on as we were */
+static void upgrade(void) {
+  struct upgrade u;
+  char env[16];
+  int sv[2];
 
-  if(strncmp(line, "PING ", 5) == 0) {
-    line[1] = 'O';/* PING -> PONG */
-    irc_write(irc_fd, line);
+  /* OpenSSL can't hand a live session to another process */
+  if(tls) {
+    fprintf(stderr, "fifoirc: can't upgrade with a TLS connection open\n");
+    return;
+  }
+  if(irc_state == IRC_CONNECTING && irc_fd != -1) {
+    fprintf(stderr, "fifoirc: can't upgrade while connecting\n");
+    return;
   }
 
-  p = strchr(line, ' ');
-  if(p && strncmp(p, " PRIVMSG ", 9) == 0) {
-    *endline = '\n';
-    *(endline + 1) = '\0';
-    if((p = strchr(p, ':'))) {
-      write(program_fd, p + 1, strlen(p + 1));
-    }
+  /* the new binary carries on from the last whole line */
+  uring_flush();
 
-    /* handle ctcp version */
-    if(strcmp(p, ":\x01VERSION\x01\n") == 0) {
-      nick = line + 1;/* skip the leading colon */
-      if((p = strchr(line, '!'))) *p = '\0';/* lose everything after the nick */
-      snprintf(msg, BUFLEN, "NOTICE %s :\x01VERSION fifoirc\x01", nick);
-      irc_write(irc_fd, msg);
-    }
+  memset(&u, 0, sizeof(u));
+  u.saving = 1;
+  u.fds[u.nfds++] = memfd_create("fifoirc-upgrade", MFD_CLOEXEC);
+  if(u.fds[0] == -1 || !(u.f = fdopen(u.fds[0], "w+"))) {
+    perror("fifoirc: upgrade");
+    if(u.fds[0] != -1) close(u.fds[0]);
+    return;
   }
-}
 
-static void text_handle(int fd) {
-  /* the 450-byte buffer ensures that
-   *  a.) the message we send to the server will fit in IRC's 512 byte limit
-   *  b.) the message the server sends to other clients which includes our
-   *      full nick!username@host string will fit in 512 bytes
-   */
-  char line[450];
-  char *p;
-  int len;
+  up_state(&u);
+  if(u.err || fflush(u.f) == EOF) {
+    fprintf(stderr, "fifoirc: upgrade: can't save state\n");
+    fclose(u.f);
+    return;
+  }
 
-  len = snprintf(line, 450, "PRIVMSG %s :", channel);
-  p = line + len;
-  len = 450 - len;
+  if(socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, sv) == -1) {
+    perror("fifoirc: upgrade");
+    fclose(u.f);
+    return;
+  }
+
+  /* the new binary finds the other end of the socket in the environment */
+  if(upgrade_send(sv[0], u.fds, u.nfds) == 0
+     && fcntl(sv[1], F_SETFD, 0) == 0) {
+    snprintf(env, sizeof(env), "%d", sv[1]);
+    setenv(UPGRADE_ENV, env, 1);
 
-  get_line(fd, p, len);
+    if(verbose > INFO) printf(" -- upgrading to %s\n", main_argv[0]);
+    fflush(stdout);
+    fflush(stderr);
 
-  if((p = strchr(line, '\n'))) *p = '\0';
+    execvp(main_argv[0], main_argv);
+    unsetenv(UPGRADE_ENV);
+  }
 
-  irc_write(irc_fd, line);
+  /* closing the socket takes the descriptors in flight with it */
+  fprintf(stderr, "fifoirc: upgrade: %s: %s\n", main_argv[0],
+          strerror(errno));
+  close(sv[0]);
+  close(sv[1]);
+  fclose(u.f);
 }
 
-static void quit(int sig) {
-  irc_write(irc_fd, "QUIT");
+/* take over from the binary that exec'd us; returns 0 if there was nothing
+ * to take over, and we have to start from scratch */
+static int upgrade_restore(int sock) {
+  struct upgrade u;
+  int i;
 
-  exit(EXIT_SUCCESS);
+  memset(&u, 0, sizeof(u));
+  u.nfds = upgrade_recv(sock, u.fds);
+  close(sock);
+  if(u.nfds < 1) {
+    perror("fifoirc: upgrade");
+    return 0;
+  }
+
+  if(lseek(u.fds[0], 0, SEEK_SET) == -1 || !(u.f = fdopen(u.fds[0], "r"))) {
+    perror("fifoirc: upgrade");
+    for(i = 0; i < u.nfds; i++)
+      close(u.fds[i]);
+    return 0;
+  }
+
+  up_state(&u);
+  fclose(u.f);
+
+  if(u.err == 2) {
+    fprintf(stderr, "fifoirc: upgrade: state from another version, "
+            "starting afresh\n");
+    for(i = 1; i < u.nfds; i++)
+      close(u.fds[i]);
+    return 0;
+  }
+  if(u.err) {
+    fprintf(stderr, "fifoirc: upgrade: state from the old binary unreadable\n");
+    return -1;
+  }
+
+  server = servers[cur_server < nservers ? cur_server : 0];
+  if(ring_fd != -1 && ring_map() == -1) return -1;
+
+  if(verbose > INFO)
+    printf(" -- upgraded: %d descriptors and %lu lines taken over\n",
+           u.nfds - 1, queue_len + msg_count(sent_head));
+
+  queue_flush();
+
+  return 1;
 }
 
-static void unlink_fifo(void) {
-  unlink(fifo);
+/* deal with the signals that come through sig_fd */
+static void handle_signals(void) {
+  struct signalfd_siginfo si;
+  int hup = 0, usr2 = 0, term = 0;
+
+  while(read(sig_fd, &si, sizeof(si)) == sizeof(si)) {
+    if(si.ssi_signo == SIGHUP && config_path) hup = 1;
+    else if(si.ssi_signo == SIGUSR2) usr2 = 1;
+    else if(si.ssi_signo != SIGCHLD) term++;
+  }
+
+  reap_children();
+
+  /* there's no going back once shutdown has started */
+  while(term--) shutdown_start();
+  if(shutdown_at) return;
+
+  if(hup) reload_config();
+  if(usr2) upgrade();
 }
 
 int main(int argc, char **argv) {
-  int c, i;
+  int c, i, sig, first, upgraded = 0;
   int status;
-  struct pollfd fd[3];
-  char msg[BUFLEN];
+  int timeout;
+  struct pollfd fd[MAXPOLL];
+  struct child *ch;
+  char buf[64];
   char *home;
   char *p;
 
   if(argc <= 1) usage();
 
+  /* to exec again on SIGUSR2, before getopt() shuffles it and the password
+   * is scrubbed from it */
+  if(!(main_argv = calloc(argc + 1, sizeof(char *)))) {
+    perror("fifoirc: malloc");
+    return 1;
+  }
+  for(i = 0; i < argc; i++)
+    main_argv[i] = strdup(argv[i]);
+  if(!(cli_options = calloc(argc, sizeof(*cli_options)))) {
+    perror("fifoirc: malloc");
+    return 1;
+  }
+
   opterr = 0;
 
-  while((c = getopt(argc, argv, "c:e:f:F:m:n:p:P:rs:v")) != -1) {
-    switch(c) {
-    case 'c': channel = optarg;                      break;
-    case 'e': program = optarg;                      break;
-    case 'f': fifo = optarg;                         break;
-    case 'F': fullname = optarg;                     break;
-    case 'm': fifo_perms = strtoul(optarg, NULL, 8); break;
-    case 'n': nickname = optarg;                     break;
-    case 'p': port = atoi(optarg);                   break;
-    case 'P': nspasswd = optarg;                     break;
-    case 'r': reconnect = 1;                         break;
-    case 's': server = optarg;                       break;
-    case 'v': verbose++;                             break;
-    default:  usage();                               break;
+  while((c = getopt(argc, argv, OPTIONS)) != -1) {
+    if(set_option(c, optarg) == -1) usage();
+    if(c == 'i') {
+      ncli_options = 0;
+      file_verbose = verbose;
+      file_nservers = nservers;
+      file_nweights = nweights;
+    } else if(config_path) {
+      cli_options[ncli_options].opt = c;
+      cli_options[ncli_options++].arg = optarg;
     }
   }
 
@@ -324,6 +4287,8 @@ int main(int argc, char **argv) {
   if(nspasswd && strlen(nspasswd) > 1) {
     p = nspasswd;
     nspasswd = strdup(nspasswd);
+    for(i = 0; i < ncli_options; i++)
+      if(cli_options[i].arg == p) cli_options[i].arg = nspasswd;
 
     p[0] = '?';
     for(i = 1; p[i]; i++)
@@ -351,69 +4316,177 @@ int main(int argc, char **argv) {
 
   if(!fullname) fullname = nickname;
 
-  if(make_fifo() == -1) return 1;
-  if(verbose > INFO) printf(" -- fifo at %s\n", fifo);
+  if(program && direct_exec && split_program() == -1) usage();
+
+  if(nchildren < 1 || nchildren > MAXCHILDREN) {
+    fprintf(stderr, "fifoirc: -j: between 1 and %d children\n", MAXCHILDREN);
+    return 1;
+  }
+
+  if(!nservers) nservers = 1;
+  server = servers[0];
+
+  if(tls_cert) use_tls = 1;
+  if(!port) port = use_tls ? 6697 : 6667;
+  if(use_tls && tls_init() == -1) return 1;
+
+  if(make_sigfd() == -1) return 1;
+
+  if(use_uring && make_uring() == -1)
+    fprintf(stderr, "fifoirc: -E uring: using poll() instead\n");
+
+  /* all of them, as -j may be raised by a reload */
+  standby.fd = -1;
+  for(i = 0; i < MAXCHILDREN; i++)
+    children[i].fd = -1;
+
+  srandom(time(NULL) ^ getpid());
+
+  /* after SIGUSR2, the binary we replaced has done the rest already */
+  if((p = getenv(UPGRADE_ENV))) {
+    unsetenv(UPGRADE_ENV);
+    if((upgraded = upgrade_restore(atoi(p))) == -1) return 1;
+  }
+
+  if(!upgraded) {
+    if(make_fifo(fifo, &fifo_fd) == -1) return 1;
+    if(urgent_fifo && make_fifo(urgent_fifo, &urgent_fd) == -1) return 1;
+    if(raw_fifo && make_fifo(raw_fifo, &raw_fd) == -1) return 1;
+    if(verbose > INFO) printf(" -- fifo at %s\n", fifo);
+    if(verbose > INFO && urgent_fifo)
+      printf(" -- urgent fifo at %s\n", urgent_fifo);
+    if(verbose > INFO && raw_fifo)
+      printf(" -- raw fifo at %s\n", raw_fifo);
+  }
 
   atexit(unlink_fifo);
 
-  if(program && start_program() == -1) return 1;
-  if(verbose > INFO) printf(" -- started '%s'\n", program);
+  if(!upgraded) {
+    if(ring_path && make_ring() == -1) return 1;
+    if(sock_path && make_socket() == -1) return 1;
 
-  irc_connect();
+    for(i = 0; program && i < nchildren; i++)
+      if(start_program(&children[i]) == -1) return 1;
+    if(program && use_standby && start_program(&standby) == -1) return 1;
+
+    irc_connect();
+  }
 
-  signal(SIGINT, quit);
-  signal(SIGTERM, quit);
-  signal(SIGHUP, quit);
+  signal(SIGPIPE, SIG_IGN);
 
   while(1) {
+    timeout = timers();
+
     i = 0;
     fd[i].fd = fifo_fd;
     fd[i].events = POLLIN;
     i++;
-    fd[i].fd = irc_fd;
+    fd[i].fd = irc_fd;/* ignored by poll() while it's -1 */
+    if(irc_state == IRC_CONNECTING) fd[i].events = irc_events;
+    else fd[i].events = children_full() ? 0 : POLLIN;
+    i++;
+    for(c = 0; program && c < nchildren; c++) {
+      fd[i].fd = children[c].fd;
+      fd[i].events = POLLIN | (children[c].outlen ? POLLOUT : 0);
+      i++;
+    }
+    sig = i;
+    fd[i].fd = sig_fd;
+    fd[i].events = POLLIN;
+    i++;
+    fd[i].fd = urgent_fd;
+    fd[i].events = POLLIN;
+    i++;
+    fd[i].fd = raw_ready() ? raw_fd : -1;
     fd[i].events = POLLIN;
     i++;
-    if(program) {
-      fd[i].fd = program_fd;
+    fd[i].fd = bell_fd;
+    fd[i].events = POLLIN;
+    i++;
+    fd[i].fd = listen_fd;
+    fd[i].events = POLLIN;
+    i++;
+    first = i;
+    for(c = 0; c < nwriters; c++) {
+      fd[i].fd = writers[c].fd;
       fd[i].events = POLLIN;
       i++;
     }
 
-    c = poll(fd, i, 600000);
+    if(ring && !shutdown_at && ring_sleep()) timeout = 0;
 
-    /* restart the child if it died */
-    if(program && waitpid(childpid, &status, WNOHANG))
-        if(start_program() == -1) break;
+    if(uring_fd != -1) c = uring_poll(fd, i, timeout);
+    else c = poll(fd, i, timeout);
 
     if(c == -1) {
       perror("fifoirc: poll");
       break;
-    } else if(c == 0) {/* timeout */
-      if(time(NULL) > recv_time + 600) {
-        fprintf(stderr, "fifoirc: ping timeout: %d seconds\n",
-                (int)(time(NULL) - recv_time));
-        irc_disconnect();
+    } else if(c > 0) {
+      /* only reopen once everything the writer left has been read; urgent
+       * lines first, so that they're queued before bulk ones are sent */
+      if(fd[first - 4].revents & POLLIN) {
+        if(text_handle(urgent_fd, &urgent_in, urgent_line) == -1
+           && make_fifo(urgent_fifo, &urgent_fd) == -1) break;
+      } else if(fd[first - 4].revents & POLLHUP) {
+        if(make_fifo(urgent_fifo, &urgent_fd) == -1) break;
       }
 
-      snprintf(msg, BUFLEN, "PING :%s", server);
-      irc_write(irc_fd, msg);
-    } else {
-      if(fd[0].revents & POLLIN) text_handle(fifo_fd);
-      if(fd[0].revents & POLLHUP)
-        if(make_fifo() == -1) break;
+      if(fd[first - 3].revents & POLLIN) {
+        if(raw_read() == -1 && raw_reopen() == -1) break;
+      } else if(fd[first - 3].revents & POLLHUP) {
+        if(raw_reopen() == -1) break;
+      }
+
+      if(fd[0].revents & POLLIN) {
+        if(text_handle(fifo_fd, &fifo_in, fifo_line) == -1
+           && make_fifo(fifo, &fifo_fd) == -1) break;
+      } else if(fd[0].revents & POLLHUP) {
+        if(make_fifo(fifo, &fifo_fd) == -1) break;
+      }
+
+      if(irc_state == IRC_CONNECTING) {
+        if(fd[1].revents) irc_connecting();
+      } else {
+        if(fd[1].revents & POLLIN) irc_handle();
+        else if(fd[1].revents & (POLLHUP | POLLERR)) irc_disconnect();
+      }
+
+      for(c = 0; program && c < nchildren; c++) {
+        ch = &children[c];
+        if(fd[2 + c].revents & POLLOUT) child_flush(ch);
+        if(fd[2 + c].revents & POLLIN) {
+          status = text_handle(ch->fd, &ch->in, program_line);
+          if(status == -1) child_hangup(ch);
+          else ch->replies += status;
+        } else if(fd[2 + c].revents & POLLHUP) {
+          child_hangup(ch);
+        }
+      }
+
+      /* after the children's last words have been read */
+      if(fd[sig].revents & POLLIN) handle_signals();
 
-      if(fd[1].revents & POLLIN) irc_handle();
-      if(fd[1].revents & POLLHUP) irc_disconnect();
+      if(fd[first - 2].revents & POLLIN)
+        while(read(bell_fd, buf, sizeof(buf)) > 0);
 
-      if(program) {
-        if(fd[2].revents & POLLIN) text_handle(program_fd);
-        if(fd[2].revents & POLLHUP)
-          if(start_program() == -1) break;
+      /* shutting down may have closed them since the poll() */
+      for(c = 0; c < i - first; c++)
+        if(writers[c].fd != -1
+           && fd[first + c].revents & (POLLIN | POLLHUP | POLLERR))
+          writer_read(&writers[c]);
+
+      /* forget writers that have gone before making room for new ones */
+      for(c = 0; c < nwriters;) {
+        if(writers[c].fd == -1) writers[c] = writers[--nwriters];
+        else c++;
       }
+      if(fd[first - 1].revents & POLLIN) writer_accept();
     }
+
+    if(ring && !shutdown_at) ring_read();
   }
 
-  quit(0);
+  quit();
 
   return 0;
 }